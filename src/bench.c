@@ -0,0 +1,377 @@
+/*      (C) 2024 Alin-Adrian Anton <alin.anton@cs.upt.ro>, Petra Csereoka <petra.csereoka@cs.upt.ro>
+ *
+ *      This program is free software: you can redistribute it and/or modify it under the terms of the
+ *      GNU General Public License as published by the Free Software Foundation,
+ *      either version 3 of the License, or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *      without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *      See the GNU General Public License for more details.
+ *      You should have received a copy of the GNU General Public License along with this program.
+ *      If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  Benchmarks, results go to stdout as one JSON object:
+ *
+ *  throughput   ns/byte and cycles/byte of SpeckREncrypt, SpeckREncrypt_async,
+ *               speckr_xor_inline and SpeckREncrypt_blocks on every kernel the
+ *               CPU has, per buffer size
+ *  latency      per-call percentiles of SpeckREncrypt, calls that end an epoch
+ *               (2000-block Sbox update) are also reported on their own
+ *  init         speckr_init_ex() wall time per KDF profile and Argon2 cost
+ *  parallel     speckr_encrypt_parallel() throughput per thread count
+ *
+ *  cycles are rdtsc ticks on x86 and null elsewhere. -q runs smaller sizes and
+ *  skips the default (64 MiB, 20 pass) KDF cost.
+ *
+ *  Before measuring, the inline path of speckr_inline.h, SpeckREncrypt() and
+ *  every kernel of SpeckREncrypt_blocks() must give the same bytes across Sbox1
+ *  and Sbox2 updates, and the kernels and speckr_seek() those of a plain
+ *  per-block SpeckREncrypt() run from speckr_init(); bench exits 1 if they do
+ *  not. -c only runs those checks.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "speckr.h"
+#include "speckr_inline.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+static uint64_t ticks(void) { return __rdtsc(); }
+#else
+#define HAVE_TSC 0
+static uint64_t ticks(void) { return 0; }
+#endif
+
+#define WARMUP 3
+#define REPEAT 7
+#define LAT_CALLS (50 * SPECKR_EPOCH)
+
+static const char *password = "Bench-Passw0rd!";
+static const char *kernels[] = { "scalar", "sse4", "avx2", "avx512", "avx512vbmi" };
+static int quick;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    uint64_t ns, cycles;
+} sample;
+
+enum { F_SINGLE, F_ASYNC, F_INLINE, F_BLOCKS };
+
+static void run(int f, const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX) {
+    size_t i;
+
+    switch (f) {
+    case F_SINGLE:
+        for (i = 0; i < nblocks; i++)
+            SpeckREncrypt(&Pt[2 * i], &Ct[2 * i], CTX);
+        break;
+    case F_ASYNC:
+        for (i = 0; i < nblocks; i++)
+            SpeckREncrypt_async(&Pt[2 * i], &Ct[2 * i], CTX, 1, 8 * nblocks, 8 * i);
+        break;
+    case F_INLINE:
+        speckr_xor_inline(CTX, Pt, Ct, nblocks);
+        break;
+    default:
+        SpeckREncrypt_blocks(Pt, Ct, nblocks, CTX);
+    }
+}
+
+/* best of REPEAT runs after WARMUP, the minimum is the least noisy estimate */
+static sample time_run(int f, const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX) {
+    sample best = { UINT64_MAX, UINT64_MAX }, s;
+    uint64_t c0, t0;
+    int r;
+
+    for (r = 0; r < WARMUP + REPEAT; r++) {
+        t0 = now_ns(); c0 = ticks();
+        run(f, Pt, Ct, nblocks, CTX);
+        s.cycles = ticks() - c0; s.ns = now_ns() - t0;
+        if (r >= WARMUP && s.ns < best.ns)
+            best = s;
+    }
+    return best;
+}
+
+/* one entry of the current array, sep is reset at the start of each array */
+static const char *sep;
+
+static void print_rate(const char *fn, const char *kernel, size_t bytes, sample s) {
+    printf("%s    {\"fn\": \"%s\", \"kernel\": \"%s\", \"bytes\": %zu, \"ns_per_byte\": %.4f, ",
+            sep, fn, kernel, bytes, (double)s.ns / bytes);
+    if (HAVE_TSC)
+        printf("\"cycles_per_byte\": %.4f}", (double)s.cycles / bytes);
+    else
+        printf("\"cycles_per_byte\": null}");
+    sep = ",\n";
+}
+
+static void bench_throughput(speckr_ctx *CTX, uint32_t *Pt, uint32_t *Ct) {
+    size_t sizes[] = { 64, 1 << 10, 16 << 10, 256 << 10, 4 << 20, 32 << 20 };
+    size_t nsizes = quick ? 4 : sizeof(sizes) / sizeof(sizes[0]);
+    size_t i, k;
+
+    printf("  \"throughput\": [\n");
+    sep = "";
+    for (i = 0; i < nsizes; i++) {
+        size_t n = sizes[i] / 8;
+
+        speckr_reset_ctr(CTX);
+        print_rate("SpeckREncrypt", speckr_kernel_name(), sizes[i], time_run(F_SINGLE, Pt, Ct, n, CTX));
+        speckr_reset_ctr(CTX);
+        print_rate("SpeckREncrypt_async", speckr_kernel_name(), sizes[i], time_run(F_ASYNC, Pt, Ct, n, CTX));
+        speckr_reset_ctr(CTX);
+        print_rate("speckr_xor_inline", "inline", sizes[i], time_run(F_INLINE, Pt, Ct, n, CTX));
+        for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (speckr_set_kernel(kernels[k]) != 0)
+                continue;
+            speckr_reset_ctr(CTX);
+            print_rate("SpeckREncrypt_blocks", kernels[k], sizes[i], time_run(F_BLOCKS, Pt, Ct, n, CTX));
+        }
+        speckr_set_kernel(NULL);
+    }
+    printf("\n  ],\n");
+}
+
+static void print_pct(const char *name, uint64_t *v, size_t n, const char *unit, int last) {
+    qsort(v, n, sizeof(v[0]), cmp_u64);
+    printf("    \"%s\": {\"unit\": \"%s\", \"calls\": %zu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}%s\n",
+            name, unit, n, (unsigned long long)v[n / 2], (unsigned long long)v[n * 99 / 100],
+            (unsigned long long)v[n * 999 / 1000], (unsigned long long)v[n - 1], last ? "" : ",");
+}
+
+/* one block per call, a call is an epoch boundary when it triggers the Sbox update */
+static void bench_latency(speckr_ctx *CTX, const uint32_t *Pt, uint32_t *Ct) {
+    uint64_t *all = malloc(LAT_CALLS * sizeof(uint64_t)), *edge = malloc(LAT_CALLS / SPECKR_EPOCH * sizeof(uint64_t));
+    uint64_t t0;
+    size_t i, ne = 0;
+
+    if (all == NULL || edge == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    speckr_reset_ctr(CTX);
+    for (i = 0; i < LAT_CALLS; i++) {
+        t0 = HAVE_TSC ? ticks() : now_ns();
+        SpeckREncrypt(&Pt[2 * (i % 1024)], &Ct[2 * (i % 1024)], CTX);
+        all[i] = (HAVE_TSC ? ticks() : now_ns()) - t0;
+        if (CTX->it1 == 0)
+            edge[ne++] = all[i];
+    }
+    printf("  \"latency\": {\n");
+    print_pct("SpeckREncrypt", all, LAT_CALLS, HAVE_TSC ? "cycles" : "ns", 0);
+    print_pct("SpeckREncrypt_epoch_boundary", edge, ne, HAVE_TSC ? "cycles" : "ns", 1);
+    printf("  },\n");
+    free(all);
+    free(edge);
+}
+
+static void bench_init(void) {
+    struct { uint32_t t_cost, m_cost; } costs[] = { { 2, 1 << 12 }, { 4, 1 << 14 }, { 2, 1 << 16 }, { 20, 1 << 16 } };
+    size_t ncosts = sizeof(costs) / sizeof(costs[0]) - quick;
+    int profiles[] = { SPECKR_KDF_V1, SPECKR_KDF_V2 };
+    speckr_kdf_params params;
+    speckr_ctx CTX;
+    uint64_t t[3], t0;
+    size_t i, p, r;
+
+    printf("  \"init\": [\n");
+    for (p = 0; p < 2; p++)
+        for (i = 0; i < ncosts; i++) {
+            speckr_kdf_defaults(&params, profiles[p]);
+            params.t_cost = costs[i].t_cost;
+            params.m_cost = costs[i].m_cost;
+            for (r = 0; r < 3; r++) {
+                t0 = now_ns();
+                if (speckr_init_ex(&CTX, password, &params) != 0) {
+                    fprintf(stderr, "speckr_init_ex failed\n");
+                    exit(1);
+                }
+                t[r] = now_ns() - t0;
+            }
+            qsort(t, 3, sizeof(t[0]), cmp_u64);
+            printf("    {\"profile\": %d, \"t_cost\": %u, \"m_cost_kib\": %u, \"parallelism\": %u, \"ms_min\": %.3f, \"ms_median\": %.3f}%s\n",
+                    profiles[p], params.t_cost, params.m_cost, params.parallelism, t[0] / 1e6, t[1] / 1e6,
+                    p == 1 && i == ncosts - 1 ? "" : ",");
+        }
+    printf("  ],\n");
+}
+
+static void bench_parallel(speckr_ctx *CTX, const uint32_t *Pt, uint32_t *Ct, size_t nblocks) {
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN), n, r;
+    uint64_t best, t0, dt;
+
+    printf("  \"parallel\": [\n");
+    for (n = 1; ; n = n * 2 > ncpu && n < ncpu ? ncpu : n * 2) {
+        best = UINT64_MAX;
+        for (r = 0; r < 1 + REPEAT; r++) {
+            speckr_reset_ctr(CTX);
+            t0 = now_ns();
+            speckr_encrypt_parallel(Pt, Ct, nblocks, CTX, n);
+            dt = now_ns() - t0;
+            if (r > 0 && dt < best)
+                best = dt;
+        }
+        printf("    {\"threads\": %d, \"bytes\": %zu, \"mib_per_s\": %.1f}%s\n", n, 8 * nblocks,
+                8.0 * nblocks / (1 << 20) / (best / 1e9), n >= ncpu ? "" : ",");
+        if (n >= ncpu)
+            break;
+    }
+    printf("  ]\n");
+}
+
+/*
+ *  nblocks from block start through the inline path, SpeckREncrypt() and each
+ *  kernel; start is just before the first Sbox2 update so both epoch kinds
+ *  are crossed. Returns the number of paths that differ from the inline one.
+ */
+static int check_paths(const speckr_ctx *CTX, const uint32_t *Pt, uint32_t *Ct, size_t nblocks) {
+    const uint64_t start = (uint64_t)SPECKR_EPOCH * SPECKR_EPOCH - 3 * SPECKR_EPOCH - 5;
+    uint32_t *ref = malloc(8 * nblocks);
+    speckr_ctx c;
+    size_t i, k;
+    int bad = 0;
+
+    if (ref == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    speckr_ctx_dup(&c, (speckr_ctx *)CTX);
+    speckr_seek(&c, start);
+    speckr_xor_inline(&c, Pt, ref, nblocks);
+
+    speckr_ctx_dup(&c, (speckr_ctx *)CTX);
+    speckr_seek(&c, start);
+    for (i = 0; i < nblocks; i++)
+        SpeckREncrypt(&Pt[2 * i], &Ct[2 * i], &c);
+    if (memcmp(Ct, ref, 8 * nblocks) != 0) {
+        fprintf(stderr, "check: SpeckREncrypt differs from speckr_xor_inline\n");
+        bad++;
+    }
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (speckr_set_kernel(kernels[k]) != 0)
+            continue;
+        speckr_ctx_dup(&c, (speckr_ctx *)CTX);
+        speckr_seek(&c, start);
+        SpeckREncrypt_blocks(Pt, Ct, 7, &c); // an odd split leaves the kernels a partial batch
+        SpeckREncrypt_blocks(Pt + 14, Ct + 14, nblocks - 7, &c);
+        if (memcmp(Ct, ref, 8 * nblocks) != 0) {
+            fprintf(stderr, "check: SpeckREncrypt_blocks on %s differs from speckr_xor_inline\n", kernels[k]);
+            bad++;
+        }
+    }
+    speckr_set_kernel(NULL);
+    free(ref);
+    return bad;
+}
+
+/*
+ *  Without speckr_seek(): nblocks (more than an epoch) from the fresh
+ *  speckr_init() context CTX, one SpeckREncrypt() per block, are the reference
+ *  for every kernel run from the same start and for a seek into the middle.
+ */
+static int check_from_init(const speckr_ctx *CTX, const uint32_t *Pt, uint32_t *Ct, size_t nblocks) {
+    const size_t mid = nblocks / 2 + 3;
+    uint32_t *ref = malloc(8 * nblocks);
+    speckr_ctx c;
+    size_t i, k;
+    int bad = 0;
+
+    if (ref == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    speckr_ctx_dup(&c, (speckr_ctx *)CTX);
+    for (i = 0; i < nblocks; i++)
+        SpeckREncrypt(&Pt[2 * i], &ref[2 * i], &c);
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (speckr_set_kernel(kernels[k]) != 0)
+            continue;
+        speckr_ctx_dup(&c, (speckr_ctx *)CTX);
+        SpeckREncrypt_blocks(Pt, Ct, nblocks, &c);
+        if (memcmp(Ct, ref, 8 * nblocks) != 0) {
+            fprintf(stderr, "check: SpeckREncrypt_blocks on %s differs from SpeckREncrypt after speckr_init\n", kernels[k]);
+            bad++;
+        }
+    }
+    speckr_set_kernel(NULL);
+
+    speckr_ctx_dup(&c, (speckr_ctx *)CTX);
+    speckr_seek(&c, mid);
+    SpeckREncrypt_blocks(Pt + 2 * mid, Ct, nblocks - mid, &c);
+    if (memcmp(Ct, ref + 2 * mid, 8 * (nblocks - mid)) != 0) {
+        fprintf(stderr, "check: speckr_seek differs from SpeckREncrypt after speckr_init\n");
+        bad++;
+    }
+    free(ref);
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    size_t maxbytes, i;
+    uint32_t *Pt, *Ct;
+    speckr_ctx CTX;
+    int opt, check_only = 0;
+
+    while ((opt = getopt(argc, argv, "qc")) != -1) {
+        if (opt == 'q')
+            quick = 1;
+        else if (opt == 'c')
+            check_only = 1;
+        else {
+            fprintf(stderr, "usage: %s [-q | -c]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    maxbytes = quick ? 16 << 20 : 256 << 20; // parallel buffer, also covers the largest throughput size
+    if ((Pt = malloc(maxbytes)) == NULL || (Ct = malloc(maxbytes)) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < maxbytes / 4; i++)
+        Pt[i] = (uint32_t)i * 2654435761u;
+
+    speckr_init(&CTX, password);
+
+    if (check_from_init(&CTX, Pt, Ct, 3 * SPECKR_EPOCH + 17) + check_paths(&CTX, Pt, Ct, 6 * SPECKR_EPOCH + 11) != 0)
+        return 1;
+    if (check_only) {
+        fprintf(stderr, "check: inline, SpeckREncrypt and all kernels agree\n");
+        return 0;
+    }
+
+    printf("{\n  \"kernel\": \"%s\",\n  \"tsc\": %s,\n", speckr_kernel_name(), HAVE_TSC ? "true" : "false");
+    bench_throughput(&CTX, Pt, Ct);
+    bench_latency(&CTX, Pt, Ct);
+    bench_init();
+    bench_parallel(&CTX, Pt, Ct, maxbytes / 8);
+    printf("}\n");
+
+    free(Pt);
+    free(Ct);
+    return 0;
+}
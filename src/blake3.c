@@ -0,0 +1,318 @@
+/*
+ *      Portable BLAKE3, after the reference implementation of the BLAKE3 team
+ *      (CC0 / Apache-2.0). One compression at a time, no SIMD.
+ *
+ *      This program is free software: you can redistribute it and/or modify it under the terms of the
+ *      GNU General Public License as published by the Free Software Foundation,
+ *      either version 3 of the License, or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *      without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *      See the GNU General Public License for more details.
+ *      You should have received a copy of the GNU General Public License along with this program.
+ *      If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "blake3.h"
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+static const uint32_t IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t rotr32(uint32_t w, int c) {
+	return (w >> c) | (w << (32 - c));
+}
+
+static inline uint32_t load32(const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(uint8_t *p, uint32_t w) {
+	p[0] = (uint8_t)w; p[1] = (uint8_t)(w >> 8); p[2] = (uint8_t)(w >> 16); p[3] = (uint8_t)(w >> 24);
+}
+
+#define G(a, b, c, d, x, y) do { \
+	s[a] += s[b] + (x); s[d] = rotr32(s[d] ^ s[a], 16); \
+	s[c] += s[d];       s[b] = rotr32(s[b] ^ s[c], 12); \
+	s[a] += s[b] + (y); s[d] = rotr32(s[d] ^ s[a], 8);  \
+	s[c] += s[d];       s[b] = rotr32(s[b] ^ s[c], 7);  \
+} while (0)
+
+/* the 16 state words after 7 rounds, before the feed-forward */
+static void compress(uint32_t s[16], const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+		uint8_t block_len, uint64_t counter, uint8_t flags) {
+	uint32_t m[16];
+	const uint8_t *r;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = load32(block + 4 * i);
+	memcpy(s, cv, 32);
+	memcpy(s + 8, IV, 16);
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = block_len;
+	s[15] = flags;
+
+	for (i = 0; i < 7; i++) {
+		r = MSG_SCHEDULE[i];
+		G(0, 4, 8, 12, m[r[0]], m[r[1]]);
+		G(1, 5, 9, 13, m[r[2]], m[r[3]]);
+		G(2, 6, 10, 14, m[r[4]], m[r[5]]);
+		G(3, 7, 11, 15, m[r[6]], m[r[7]]);
+		G(0, 5, 10, 15, m[r[8]], m[r[9]]);
+		G(1, 6, 11, 12, m[r[10]], m[r[11]]);
+		G(2, 7, 8, 13, m[r[12]], m[r[13]]);
+		G(3, 4, 9, 14, m[r[14]], m[r[15]]);
+	}
+}
+
+static void compress_cv(uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+		uint64_t counter, uint8_t flags) {
+	uint32_t s[16];
+	int i;
+
+	compress(s, cv, block, block_len, counter, flags);
+	for (i = 0; i < 8; i++)
+		cv[i] = s[i] ^ s[i + 8];
+}
+
+/*
+ *  A node that has not been compressed yet: either the last block of a chunk or
+ *  a parent. Its chaining value and the root output both come from it.
+ */
+typedef struct {
+	uint32_t cv[8];
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	uint8_t block_len;
+	uint64_t counter;
+	uint8_t flags;
+} output_t;
+
+static void output_cv(const output_t *o, uint8_t out[BLAKE3_OUT_LEN]) {
+	uint32_t cv[8];
+	int i;
+
+	memcpy(cv, o->cv, 32);
+	compress_cv(cv, o->block, o->block_len, o->counter, o->flags);
+	for (i = 0; i < 8; i++)
+		store32(out + 4 * i, cv[i]);
+}
+
+static void output_root(const output_t *o, uint8_t *out, size_t out_len) {
+	uint64_t counter = 0;
+	uint8_t word[4];
+	uint32_t s[16];
+	size_t n;
+	int i;
+
+	while (out_len > 0) {
+		compress(s, o->cv, o->block, o->block_len, counter++, o->flags | ROOT);
+		for (i = 0; i < 8; i++) {
+			s[i] ^= s[i + 8];
+			s[i + 8] ^= o->cv[i];
+		}
+		for (i = 0; i < 16 && out_len > 0; i++) {
+			store32(word, s[i]);
+			n = out_len < 4 ? out_len : 4;
+			memcpy(out, word, n);
+			out += n;
+			out_len -= n;
+		}
+	}
+}
+
+static void parent_output(output_t *o, const uint8_t *left, const uint8_t *right, const uint32_t key[8]) {
+	memcpy(o->cv, key, 32);
+	memcpy(o->block, left, BLAKE3_OUT_LEN);
+	memcpy(o->block + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN);
+	o->block_len = BLAKE3_BLOCK_LEN;
+	o->counter = 0;
+	o->flags = PARENT;
+}
+
+static void parent_cv(uint8_t out[BLAKE3_OUT_LEN], const uint8_t *left, const uint8_t *right, const uint32_t key[8]) {
+	output_t o;
+
+	parent_output(&o, left, right, key);
+	output_cv(&o, out);
+}
+
+static void chunk_init(blake3_chunk_state *c, const uint32_t key[8], uint64_t counter, uint8_t flags) {
+	memcpy(c->cv, key, 32);
+	c->chunk_counter = counter;
+	memset(c->buf, 0, BLAKE3_BLOCK_LEN);
+	c->buf_len = 0;
+	c->blocks_compressed = 0;
+	c->flags = flags;
+}
+
+static size_t chunk_len(const blake3_chunk_state *c) {
+	return BLAKE3_BLOCK_LEN * (size_t)c->blocks_compressed + c->buf_len;
+}
+
+static uint8_t chunk_start_flag(const blake3_chunk_state *c) {
+	return c->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+/* at most the rest of the chunk, the last block stays buffered for chunk_output() */
+static void chunk_update(blake3_chunk_state *c, const uint8_t *input, size_t len) {
+	size_t take;
+
+	while (len > 0) {
+		if (c->buf_len == BLAKE3_BLOCK_LEN) {
+			compress_cv(c->cv, c->buf, BLAKE3_BLOCK_LEN, c->chunk_counter, c->flags | chunk_start_flag(c));
+			c->blocks_compressed++;
+			c->buf_len = 0;
+			memset(c->buf, 0, BLAKE3_BLOCK_LEN);
+		}
+		take = BLAKE3_BLOCK_LEN - c->buf_len;
+		if (take > len)
+			take = len;
+		memcpy(c->buf + c->buf_len, input, take);
+		c->buf_len += (uint8_t)take;
+		input += take;
+		len -= take;
+	}
+}
+
+static void chunk_output(const blake3_chunk_state *c, output_t *o) {
+	memcpy(o->cv, c->cv, 32);
+	memcpy(o->block, c->buf, BLAKE3_BLOCK_LEN);
+	o->block_len = c->buf_len;
+	o->counter = c->chunk_counter;
+	o->flags = c->flags | chunk_start_flag(c) | CHUNK_END;
+}
+
+/*
+ *  The stack holds one chaining value per set bit of the number of chunks
+ *  already added, largest subtree at the bottom. A new subtree of nchunks
+ *  chunks is merged with the top while that completes a larger power of two.
+ */
+static void push_cv(blake3_hasher *self, uint8_t cv[BLAKE3_OUT_LEN], uint64_t total, size_t nchunks) {
+	total /= nchunks;
+	while ((total & 1) == 0) {
+		self->cv_stack_len--;
+		parent_cv(cv, self->cv_stack + BLAKE3_OUT_LEN * self->cv_stack_len, cv, self->key);
+		total >>= 1;
+	}
+	memcpy(self->cv_stack + BLAKE3_OUT_LEN * self->cv_stack_len, cv, BLAKE3_OUT_LEN);
+	self->cv_stack_len++;
+}
+
+/* a full chunk is kept until more input arrives, it might be the root */
+static void flush_chunk(blake3_hasher *self) {
+	uint64_t total = self->chunk.chunk_counter + 1;
+	uint8_t cv[BLAKE3_OUT_LEN];
+	output_t o;
+
+	chunk_output(&self->chunk, &o);
+	output_cv(&o, cv);
+	push_cv(self, cv, total, 1);
+	chunk_init(&self->chunk, self->key, total, self->chunk.flags);
+}
+
+void blake3_hasher_init(blake3_hasher *self) {
+	memcpy(self->key, IV, 32);
+	chunk_init(&self->chunk, IV, 0, 0);
+	self->cv_stack_len = 0;
+}
+
+void blake3_hasher_update(blake3_hasher *self, const void *input, size_t input_len) {
+	const uint8_t *in = input;
+	size_t take;
+
+	while (input_len > 0) {
+		if (chunk_len(&self->chunk) == BLAKE3_CHUNK_LEN)
+			flush_chunk(self);
+		take = BLAKE3_CHUNK_LEN - chunk_len(&self->chunk);
+		if (take > input_len)
+			take = input_len;
+		chunk_update(&self->chunk, in, take);
+		in += take;
+		input_len -= take;
+	}
+}
+
+void blake3_hasher_finalize(const blake3_hasher *self, uint8_t *out, size_t out_len) {
+	uint8_t cv[BLAKE3_OUT_LEN];
+	size_t n = self->cv_stack_len;
+	output_t o;
+
+	chunk_output(&self->chunk, &o);
+	while (n > 0) {
+		output_cv(&o, cv);
+		n--;
+		parent_output(&o, self->cv_stack + BLAKE3_OUT_LEN * n, cv, self->key);
+	}
+	output_root(&o, out, out_len);
+}
+
+uint64_t blake3_hasher_next_chunk(const blake3_hasher *self) {
+	size_t len = chunk_len(&self->chunk);
+
+	if (len == 0)
+		return self->chunk.chunk_counter;
+	if (len == BLAKE3_CHUNK_LEN)
+		return self->chunk.chunk_counter + 1;
+	return UINT64_MAX;
+}
+
+size_t blake3_hasher_chunk_len(const blake3_hasher *self) {
+	return chunk_len(&self->chunk);
+}
+
+void blake3_subtree_cv(const blake3_hasher *self, const uint8_t *input, size_t nchunks, uint64_t counter,
+		uint8_t cv[BLAKE3_OUT_LEN]) {
+	uint8_t left[BLAKE3_OUT_LEN], right[BLAKE3_OUT_LEN];
+	blake3_chunk_state c;
+	output_t o;
+
+	if (nchunks == 1) {
+		chunk_init(&c, self->key, counter, self->chunk.flags);
+		chunk_update(&c, input, BLAKE3_CHUNK_LEN);
+		chunk_output(&c, &o);
+		output_cv(&o, cv);
+		return;
+	}
+	nchunks /= 2;
+	blake3_subtree_cv(self, input, nchunks, counter, left);
+	blake3_subtree_cv(self, input + nchunks * BLAKE3_CHUNK_LEN, nchunks, counter + nchunks, right);
+	parent_cv(cv, left, right, self->key);
+}
+
+void blake3_parent_cv(const blake3_hasher *self, const uint8_t left[BLAKE3_OUT_LEN],
+		const uint8_t right[BLAKE3_OUT_LEN], uint8_t out[BLAKE3_OUT_LEN]) {
+	parent_cv(out, left, right, self->key);
+}
+
+void blake3_hasher_push_subtree(blake3_hasher *self, const uint8_t cv[BLAKE3_OUT_LEN], size_t nchunks) {
+	uint8_t tmp[BLAKE3_OUT_LEN];
+	uint64_t total;
+
+	if (chunk_len(&self->chunk) == BLAKE3_CHUNK_LEN)
+		flush_chunk(self);
+	total = self->chunk.chunk_counter + nchunks;
+	memcpy(tmp, cv, BLAKE3_OUT_LEN);
+	push_cv(self, tmp, total, nchunks);
+	chunk_init(&self->chunk, self->key, total, self->chunk.flags);
+}
@@ -0,0 +1,72 @@
+/*
+ *      Portable BLAKE3 (https://github.com/BLAKE3-team/BLAKE3), unkeyed hashing only.
+ *
+ *      blake3_hasher_init/update/finalize follow the official C API so the
+ *      SIMD library can replace this file. The subtree calls are the tree mode
+ *      used by speckr_encrypt_parallel_hash(): threads hash power-of-two runs of
+ *      whole chunks on their own and the results are pushed into one hasher.
+ *
+ *      This program is free software: you can redistribute it and/or modify it under the terms of the
+ *      GNU General Public License as published by the Free Software Foundation,
+ *      either version 3 of the License, or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *      without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *      See the GNU General Public License for more details.
+ *      You should have received a copy of the GNU General Public License along with this program.
+ *      If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_KEY_LEN 32
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct {
+	uint32_t cv[8];
+	uint64_t chunk_counter;
+	uint8_t buf[BLAKE3_BLOCK_LEN];
+	uint8_t buf_len;
+	uint8_t blocks_compressed;
+	uint8_t flags;
+} blake3_chunk_state;
+
+typedef struct blake3_hasher {
+	uint32_t key[8];
+	blake3_chunk_state chunk;
+	uint8_t cv_stack_len;
+	uint8_t cv_stack[(BLAKE3_MAX_DEPTH + 1) * BLAKE3_OUT_LEN];
+} blake3_hasher;
+
+void blake3_hasher_init(blake3_hasher *self);
+void blake3_hasher_update(blake3_hasher *self, const void *input, size_t input_len);
+void blake3_hasher_finalize(const blake3_hasher *self, uint8_t *out, size_t out_len);
+
+/*
+ *  Tree mode. blake3_hasher_next_chunk() is the chunk counter the next byte
+ *  starts, or UINT64_MAX if the input so far does not end on a chunk boundary;
+ *  blake3_hasher_chunk_len() is how far into its chunk the input so far ends.
+ *  blake3_subtree_cv() hashes nchunks (a power of two) whole chunks that start
+ *  at chunk counter counter, which must be a multiple of nchunks, and only
+ *  reads self. blake3_hasher_push_subtree() appends such a result at
+ *  blake3_hasher_next_chunk(); at least one more byte has to go through
+ *  blake3_hasher_update() before finalizing, the root is never a pushed subtree.
+ *  blake3_parent_cv() joins the values of two adjacent subtrees of equal size
+ *  into the one of their parent, out may be left.
+ */
+uint64_t blake3_hasher_next_chunk(const blake3_hasher *self);
+size_t blake3_hasher_chunk_len(const blake3_hasher *self);
+void blake3_subtree_cv(const blake3_hasher *self, const uint8_t *input, size_t nchunks, uint64_t counter,
+		uint8_t cv[BLAKE3_OUT_LEN]);
+void blake3_parent_cv(const blake3_hasher *self, const uint8_t left[BLAKE3_OUT_LEN],
+		const uint8_t right[BLAKE3_OUT_LEN], uint8_t out[BLAKE3_OUT_LEN]);
+void blake3_hasher_push_subtree(blake3_hasher *self, const uint8_t cv[BLAKE3_OUT_LEN], size_t nchunks);
+
+#endif /* BLAKE3_H */
@@ -13,6 +13,7 @@
 
 // Example of how to use
 
+#define _GNU_SOURCE // O_DIRECT
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -20,12 +21,25 @@
 #include <termios.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "speckr.h"
+#include "blake3.h"
 
 #define MAXPWDLEN 32
+#define BUFBLOCKS 8192 // 64 KiB per fread/fwrite
+#define DIO_ALIGN 4096 // O_DIRECT buffer, offset and length alignment
+#define DIO_BUFSIZE (8 << 20)
+#define DIO_NBUF 4 // one being read, one encrypted, one written, one spare
+#define HASH_WINDOW (1 << 30) // bytes per speckr_encrypt_parallel_hash() call, bounds its subtree table
 
 /*
  * cracklib is better for measuring weak passwords
@@ -58,43 +72,1243 @@ int isStrongPassword(const char *password) {
 }
 
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m | -d] [-H] [-t threads] [-k profile] input-filename output-filename\n", prog);
+    fprintf(stderr, "       %s -i [-H] [-t threads] [-k profile] filename\n", prog);
+    fprintf(stderr, "       %s -c [-H] [-t threads] [-k profile] input-filename container-filename\n", prog);
+    fprintf(stderr, "       %s -x [-t threads] container-filename output-filename\n", prog);
+    fprintf(stderr, "       %s -r start:end [-x | -k profile] input-filename output-filename\n", prog);
+    fprintf(stderr, "       %s -p [-t threads] [-k profile] < input > output\n", prog);
+    fprintf(stderr, "       %s -b [-x] [-t threads] [-k profile] directory-or-list output-directory\n", prog);
+    fprintf(stderr, "  -m  memory-map input and output instead of stdio\n");
+    fprintf(stderr, "  -i  encrypt/decrypt filename in place through a memory map\n");
+    fprintf(stderr, "  -d  O_DIRECT reads and writes overlapped with encryption\n");
+    fprintf(stderr, "  -t  worker threads for -m/-i/-d/-b (default: one per CPU)\n");
+    fprintf(stderr, "  -k  key derivation profile, 1 (default) or 2 (single multi-lane argon2 pass)\n");
+    fprintf(stderr, "  -c  write a container: header with the KDF parameters, random salt and length\n");
+    fprintf(stderr, "  -x  decrypt a container written by -c or -b\n");
+    fprintf(stderr, "  -r  only decrypt plaintext bytes [start, end), end may be left out for EOF\n");
+    fprintf(stderr, "  -p  stream stdin to stdout, the password is read from /dev/tty\n");
+    fprintf(stderr, "  -H  BLAKE3 of the output computed while encrypting: a trailer with -c (checked\n");
+    fprintf(stderr, "      by -x), otherwise output-filename.b3 in b3sum format\n");
+    fprintf(stderr, "  -b  batch: every file of a directory tree or of a list file (one path per line)\n");
+    fprintf(stderr, "      becomes a container under output-directory, the key is derived once;\n");
+    fprintf(stderr, "      with -x the containers are decrypted there\n");
+    fprintf(stderr, "  -S  print KDF, keystream and Sbox update counters to stderr when done\n");
+}
+
+/*
+ * -S: the library counters of this thread (workers add theirs when they finish)
+ * and the wall time of the encryption phase, which includes the I/O
+ */
+
+static void print_stats(uint64_t phase_ns) {
+    static const char *kernels[SPECKR_STATS_KERNELS] = { "scalar", "sse4", "avx2", "avx512", "avx512vbmi" };
+    speckr_stats st;
+    int i;
+
+    speckr_stats_get(&st);
+    fprintf(stderr, "kdf:    %llu init(s)", (unsigned long long)st.kdf_calls);
+    for (i = 0; i < SPECKR_STATS_PASSES; i++) 
+	if (st.kdf_ns[i] != 0) 
+	    fprintf(stderr, ", argon2 pass %d %.1f ms", i, st.kdf_ns[i] / 1e6);
+    fprintf(stderr, "\ncrypt:  %.1f ms, %llu blocks, %llu Sbox1 and %llu Sbox2 updates\n", phase_ns / 1e6, 
+	    (unsigned long long)st.blocks, (unsigned long long)st.sbox1_updates, (unsigned long long)st.sbox2_updates);
+    for (i = 0; i < SPECKR_STATS_KERNELS; i++) 
+	if (st.kernel_bytes[i] != 0) 
+	    fprintf(stderr, "kernel: %s %llu bytes\n", kernels[i], (unsigned long long)st.kernel_bytes[i]);
+}
+
+/*
+ * read a buffer, encrypt/decrypt it in one call, write it out
+ * the byte stream API handles the partial last block, no truncate() needed
+ */
+
+static void encrypt_stdio(speckr_ctx *CTX, const char *in, const char *out, blake3_hasher *h) {
+    static uint32_t pt[2 * BUFBLOCKS];
+    size_t ret;
+    FILE *fp, *fpout;
+
+    fpout = fopen(out, "w");
+    if (fpout == NULL) {
+	    perror("fopen() for writing");
+	    exit(3);
+    }
+    /*
+     *  open file for reading and writing 
+     */
+
+    fp = fopen(in, "rb+");
+    if (fp == NULL) {
+	perror("fopen()");
+	exit(2);
+    }
+
+    ret = 8 * BUFBLOCKS;
+    while(ret == 8 * BUFBLOCKS) {
+       if ((ret=fread(pt, 1, 8 * BUFBLOCKS, fp)) < 8 * BUFBLOCKS) {
+	    if (ferror(fp)) {
+	            perror("fread()");
+        	    exit(EXIT_FAILURE);
+	    }
+        }
+
+       if (ret == 0) 
+	    break;
+
+       speckr_stream_xor(CTX, (uint8_t *)pt, (uint8_t *)pt, ret);
+       if (h != NULL) 
+	    blake3_hasher_update(h, pt, ret);
+
+       if (fwrite(pt, 1, ret, fpout) != ret) { /* overwrite with ciphertext */
+            perror("fwrite()");
+            exit(EXIT_FAILURE);
+        }
+
+    }
+
+    fclose(fp); 
+    if (fclose(fpout) == EOF) {
+	perror("fclose() output file");
+	exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * len bytes from in to out, both 8-byte aligned, through the parallel path;
+ * with h the in or out side (what) is hashed in the same pass, a window at a
+ * time. The partial last block goes through a padded copy.
+ */
+
+static void crypt_buf(speckr_ctx *CTX, const uint8_t *in, uint8_t *out, size_t len, int nthreads, 
+	blake3_hasher *h, int what) {
+    uint32_t last[2];
+    size_t nblocks = len / 8, rest = len % 8, n;
+
+    if (h == NULL && speckr_encrypt_parallel((const uint32_t *)in, (uint32_t *)out, nblocks, CTX, nthreads) == -1) {
+	perror("speckr_encrypt_parallel()");
+	exit(EXIT_FAILURE);
+    }
+    for (n = 0; h != NULL && n < nblocks; n += HASH_WINDOW / 8) 
+	speckr_encrypt_parallel_hash((const uint32_t *)(in + 8 * n), (uint32_t *)(out + 8 * n), 
+		nblocks - n < HASH_WINDOW / 8 ? nblocks - n : HASH_WINDOW / 8, CTX, nthreads, h, what);
+
+    if (rest) {
+	memset(last, 0, sizeof(last));
+	memcpy(last, in + 8 * nblocks, rest);
+	if (h != NULL && what == SPECKR_HASH_IN) 
+	    blake3_hasher_update(h, last, rest);
+	SpeckREncrypt_blocks(last, last, 1, CTX);
+	memcpy(out + 8 * nblocks, last, rest);
+	if (h != NULL && what == SPECKR_HASH_OUT) 
+	    blake3_hasher_update(h, last, rest);
+    }
+}
+
+/*
+ * encrypt the mapped pages directly, out == NULL means in place
+ * the output is sized up front so no truncate() is needed
+ *
+ * len bytes starting at in_off of the input become the output after an
+ * optional hdrlen byte header, which is how containers are read and written
+ */
+
+static void encrypt_mmap(speckr_ctx *CTX, const char *in, const char *out, off_t in_off,
+	const void *hdr, size_t hdrlen, off_t len, int nthreads, blake3_hasher *h, int what) {
+    uint8_t *src = NULL, *dst;
+    off_t insize = in_off + len, outsize = hdrlen + len;
+    int fd, fdout;
+
+    fd = open(in, out == NULL ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+	perror("open()");
+	exit(2);
+    }
+    fdout = fd;
+    if (out != NULL) {
+	fdout = open(out, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fdout == -1) {
+	    perror("open() for writing");
+	    exit(3);
+	}
+	if (ftruncate(fdout, outsize) == -1) {
+	    perror("ftruncate() output file");
+	    exit(EXIT_FAILURE);
+	}
+	if (hdrlen > 0 && pwrite(fdout, hdr, hdrlen, 0) != (ssize_t)hdrlen) {
+	    perror("pwrite() header");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    if (len > 0) {
+	src = mmap(NULL, insize, out == NULL ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (src == MAP_FAILED) {
+	    perror("mmap()");
+	    exit(EXIT_FAILURE);
+	}
+	madvise(src, insize, MADV_SEQUENTIAL);
+	dst = src;
+	if (out != NULL) {
+	    dst = mmap(NULL, outsize, PROT_READ | PROT_WRITE, MAP_SHARED, fdout, 0);
+	    if (dst == MAP_FAILED) {
+		perror("mmap() output file");
+		exit(EXIT_FAILURE);
+	    }
+	    madvise(dst, outsize, MADV_SEQUENTIAL);
+	}
+
+	/* in_off and hdrlen are multiples of 8, the 32-bit word view stays aligned */
+	crypt_buf(CTX, src + in_off, dst + hdrlen, len, nthreads, h, what);
+
+	if (out != NULL) 
+	    munmap(dst, outsize);
+	munmap(src, insize);
+    }
+
+    if (out != NULL) 
+	close(fdout);
+    if (close(fd) == -1) {
+	perror("close()");
+	exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Container format (-c writes, -x reads), all integers little endian:
+ *
+ *   0  "SPKR"
+ *   4  u8  version (1)
+ *   5  u8  kdf profile
+ *   6  u16 reserved, 0
+ *   8  u32 argon2 t_cost
+ *  12  u32 argon2 m_cost (KiB)
+ *  16  u32 argon2 parallelism
+ *  20  u32 chunk size in bytes, a multiple of 8
+ *  24  u64 plaintext length
+ *  32  16 byte random argon2 salt
+ *  48  u32 flags, CONTAINER_F_BLAKE3 | CONTAINER_F_OFFSET
+ *  52  u32 reserved, 0
+ *  56  u64 stream block of the first ciphertext byte with CONTAINER_F_OFFSET, else 0
+ *  64  ciphertext, exactly plaintext length bytes
+ *      32 byte BLAKE3 of the ciphertext if CONTAINER_F_BLAKE3 is set
+ *
+ * The ciphertext is the keystream of the derived key starting at that block,
+ * so chunk i starts at file offset 64 + i * chunk size with stream block
+ * offset + i * chunk size / 8 and can be decrypted on its own after
+ * speckr_seek(). -c always starts at block 0; -b gives each file of a run its
+ * own range of the one key's stream.
+ */
+
+#define CONTAINER_MAGIC "SPKR"
+#define CONTAINER_VERSION 1
+#define CONTAINER_HDRLEN 64
+#define CONTAINER_CHUNK (8 * SPECKR_CHUNK_BLOCKS) // what speckr_encrypt_parallel() splits on
+#define CONTAINER_F_BLAKE3 1 // digest trailer, written by -c -H
+#define CONTAINER_F_OFFSET 2 // stream offset at 56, written by -b
+/* limits on the argon2 costs read from a header, they size the arena before the key is known */
+#define CONTAINER_MAX_T_COST 1000
+#define CONTAINER_MAX_M_COST (1 << 22) // 4 GiB in KiB
+#define CONTAINER_MAX_LANES 64
+
+typedef struct {
+    speckr_kdf_params kdf;
+    uint32_t chunk;
+    uint32_t flags;
+    uint64_t len;
+    uint64_t offset; // stream block
+} container_hdr;
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+    for (int i = 0; i < n; i++) 
+	p[i] = (uint8_t)(v >> 8 * i);
+}
+
+static uint64_t get_le(const uint8_t *p, int n) {
+    uint64_t v = 0;
+
+    for (int i = n - 1; i >= 0; i--) 
+	v = v << 8 | p[i];
+    return v;
+}
+
+static void container_pack(uint8_t *buf, const container_hdr *h) {
+    memset(buf, 0, CONTAINER_HDRLEN);
+    memcpy(buf, CONTAINER_MAGIC, 4);
+    buf[4] = CONTAINER_VERSION;
+    buf[5] = (uint8_t)h->kdf.profile;
+    put_le(buf + 8, h->kdf.t_cost, 4);
+    put_le(buf + 12, h->kdf.m_cost, 4);
+    put_le(buf + 16, h->kdf.parallelism, 4);
+    put_le(buf + 20, h->chunk, 4);
+    put_le(buf + 24, h->len, 8);
+    memcpy(buf + 32, h->kdf.salt, SPECKR_SALTLEN);
+    put_le(buf + 48, h->flags, 4);
+    put_le(buf + 56, h->offset, 8);
+}
+
+/* checks the header of a container of fsize bytes, NULL if it is fine, else what is wrong */
+static const char *container_parse(const uint8_t *buf, off_t fsize, container_hdr *h) {
+    off_t trailer;
+
+    if (fsize < CONTAINER_HDRLEN || memcmp(buf, CONTAINER_MAGIC, 4) != 0) 
+	return "not a SpeckR container";
+    if (buf[4] != CONTAINER_VERSION) 
+	return "unsupported container version";
+    if (buf[5] != SPECKR_KDF_V1 && buf[5] != SPECKR_KDF_V2) 
+	return "unsupported KDF profile";
+
+    speckr_kdf_defaults(&h->kdf, buf[5]);
+    h->kdf.t_cost = get_le(buf + 8, 4);
+    h->kdf.m_cost = get_le(buf + 12, 4);
+    h->kdf.parallelism = get_le(buf + 16, 4);
+    h->chunk = get_le(buf + 20, 4);
+    h->len = get_le(buf + 24, 8);
+    memcpy(h->kdf.salt, buf + 32, SPECKR_SALTLEN);
+    h->flags = get_le(buf + 48, 4);
+    h->offset = h->flags & CONTAINER_F_OFFSET ? get_le(buf + 56, 8) : 0;
+
+    if (h->flags & ~(CONTAINER_F_BLAKE3 | CONTAINER_F_OFFSET)) 
+	return "unsupported container flags";
+    if (h->kdf.t_cost < 1 || h->kdf.t_cost > CONTAINER_MAX_T_COST || h->kdf.parallelism < 1 || 
+	    h->kdf.parallelism > CONTAINER_MAX_LANES || h->kdf.m_cost < 8 * h->kdf.parallelism || 
+	    h->kdf.m_cost > CONTAINER_MAX_M_COST) 
+	return "KDF cost out of range";
+    trailer = h->flags & CONTAINER_F_BLAKE3 ? BLAKE3_OUT_LEN : 0;
+    if (h->chunk == 0 || h->chunk % 8 != 0 || fsize < CONTAINER_HDRLEN + trailer || 
+	    h->len > (uint64_t)(fsize - CONTAINER_HDRLEN - trailer)) 
+	return "corrupt container header";
+    return NULL;
+}
+
+/* reads and checks the header of a container of fsize bytes, exits if it is not one */
+static void container_read(const char *in, off_t fsize, container_hdr *h) {
+    uint8_t buf[CONTAINER_HDRLEN];
+    const char *err;
+    int fd;
+
+    fd = open(in, O_RDONLY);
+    if (fd == -1) {
+	perror("open()");
+	exit(2);
+    }
+    memset(buf, 0, sizeof(buf));
+    if (pread(fd, buf, CONTAINER_HDRLEN, 0) == -1) {
+	perror("pread()");
+	exit(2);
+    }
+    close(fd);
+    if ((err = container_parse(buf, fsize, h)) != NULL) {
+	fprintf(stderr, "%s: %s\n", in, err);
+	exit(5);
+    }
+}
+
+/* the digest trailer after len bytes of ciphertext */
+static void container_digest(const char *path, uint64_t len, uint8_t *digest, int write_it) {
+    ssize_t ret;
+    int fd;
+
+    fd = open(path, write_it ? O_WRONLY : O_RDONLY);
+    if (fd == -1) {
+	perror("open()");
+	exit(2);
+    }
+    if (write_it) 
+	ret = pwrite(fd, digest, BLAKE3_OUT_LEN, CONTAINER_HDRLEN + len);
+    else 
+	ret = pread(fd, digest, BLAKE3_OUT_LEN, CONTAINER_HDRLEN + len);
+    if (ret != BLAKE3_OUT_LEN) {
+	perror(write_it ? "pwrite() digest" : "pread() digest");
+	exit(EXIT_FAILURE);
+    }
+    if (close(fd) == -1) {
+	perror("close()");
+	exit(EXIT_FAILURE);
+    }
+}
+
+/* b3sum-style line "<hex digest>  <name>" in name.b3 */
+static void write_sidecar(const char *name, const uint8_t *digest) {
+    char path[4096];
+    FILE *fp;
+    int i;
+
+    snprintf(path, sizeof(path), "%s.b3", name);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+	perror("fopen() digest file");
+	exit(3);
+    }
+    for (i = 0; i < BLAKE3_OUT_LEN; i++) 
+	fprintf(fp, "%02x", digest[i]);
+    fprintf(fp, "  %s\n", name);
+    if (fclose(fp) == EOF) {
+	perror("fclose() digest file");
+	exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * O_DIRECT pipeline: a reader thread fills buffers, the main thread encrypts
+ * them in place and a writer thread writes them out, so reads, encryption and
+ * writes of consecutive buffers overlap. Buffers cycle FREE -> READ -> CRYPT.
+ * This is the thread-based backend; the page cache is bypassed where the
+ * filesystem supports O_DIRECT and used normally where it does not.
+ */
+
+enum { DIO_FREE, DIO_READ, DIO_CRYPT };
+
+struct dio_buf {
+    uint32_t *data;
+    size_t len;    // bytes of file data in the buffer
+    int state;
+};
+
+struct dio_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dio_buf buf[DIO_NBUF];
+    int fdin, fdout;
+    off_t fsize;
+    size_t nchunks;
+};
+
+static struct dio_buf *dio_wait(struct dio_pipe *p, size_t chunk, int state) {
+    struct dio_buf *b = &p->buf[chunk % DIO_NBUF];
+
+    pthread_mutex_lock(&p->lock);
+    while (b->state != state) 
+	pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    return b;
+}
+
+static void dio_post(struct dio_pipe *p, struct dio_buf *b, int state) {
+    pthread_mutex_lock(&p->lock);
+    b->state = state;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *dio_reader(void *arg) {
+    struct dio_pipe *p = arg;
+    struct dio_buf *b;
+    size_t chunk, done;
+    ssize_t ret;
+
+    for (chunk = 0; chunk < p->nchunks; chunk++) {
+	b = dio_wait(p, chunk, DIO_FREE);
+	b->len = p->fsize - (off_t)chunk * DIO_BUFSIZE;
+	if (b->len > DIO_BUFSIZE) 
+	    b->len = DIO_BUFSIZE;
+	for (done = 0; done < b->len; ) {
+	    ret = pread(p->fdin, (uint8_t *)b->data + done, DIO_BUFSIZE - done, (off_t)chunk * DIO_BUFSIZE + done);
+	    if (ret <= 0) {
+		perror("pread()");
+		exit(EXIT_FAILURE);
+	    }
+	    done += ret;
+	    if (done < b->len) // a short read before EOF, O_DIRECT retries from an aligned offset
+		done &= ~(size_t)(DIO_ALIGN - 1);
+	}
+	dio_post(p, b, DIO_READ);
+    }
+    return NULL;
+}
+
+static void *dio_writer(void *arg) {
+    struct dio_pipe *p = arg;
+    struct dio_buf *b;
+    size_t chunk, done, len;
+    ssize_t ret;
+
+    for (chunk = 0; chunk < p->nchunks; chunk++) {
+	b = dio_wait(p, chunk, DIO_CRYPT);
+	len = (b->len + DIO_ALIGN - 1) & ~(size_t)(DIO_ALIGN - 1); // ftruncate() trims the tail
+	for (done = 0; done < len; ) {
+	    ret = pwrite(p->fdout, (uint8_t *)b->data + done, len - done, (off_t)chunk * DIO_BUFSIZE + done);
+	    if (ret <= 0) {
+		perror("pwrite()");
+		exit(EXIT_FAILURE);
+	    }
+	    done = (done + ret) & ~(size_t)(DIO_ALIGN - 1); // len is aligned, so is every retry
+	}
+	dio_post(p, b, DIO_FREE);
+    }
+    return NULL;
+}
+
+static int dio_open(const char *path, int flags) {
+    int fd = open(path, flags | O_DIRECT, 0666);
+
+    if (fd == -1 && errno == EINVAL) // filesystem without O_DIRECT
+	fd = open(path, flags, 0666);
+    return fd;
+}
+
+static void encrypt_direct(speckr_ctx *CTX, const char *in, const char *out, off_t fsize, int nthreads, 
+	blake3_hasher *h) {
+    struct dio_pipe p;
+    struct dio_buf *b;
+    pthread_t reader, writer;
+    size_t chunk;
+    int i;
+
+    p.fdin = dio_open(in, O_RDONLY);
+    if (p.fdin == -1) {
+	perror("open()");
+	exit(2);
+    }
+    p.fdout = dio_open(out, O_WRONLY | O_CREAT | O_TRUNC);
+    if (p.fdout == -1) {
+	perror("open() for writing");
+	exit(3);
+    }
+    p.fsize = fsize;
+    p.nchunks = (fsize + DIO_BUFSIZE - 1) / DIO_BUFSIZE;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    for (i = 0; i < DIO_NBUF; i++) {
+	if (posix_memalign((void **)&p.buf[i].data, DIO_ALIGN, DIO_BUFSIZE) != 0) {
+	    fprintf(stderr, "posix_memalign() failed\n");
+	    exit(EXIT_FAILURE);
+	}
+	p.buf[i].state = DIO_FREE;
+    }
+
+    if (pthread_create(&reader, NULL, dio_reader, &p) != 0 || 
+	    pthread_create(&writer, NULL, dio_writer, &p) != 0) {
+	fprintf(stderr, "pthread_create() failed\n");
+	exit(EXIT_FAILURE);
+    }
+
+    for (chunk = 0; chunk < p.nchunks; chunk++) {
+	b = dio_wait(&p, chunk, DIO_READ); // only the last buffer ends in a partial block
+	crypt_buf(CTX, (uint8_t *)b->data, (uint8_t *)b->data, b->len, nthreads, h, SPECKR_HASH_OUT);
+	dio_post(&p, b, DIO_CRYPT);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    if (ftruncate(p.fdout, fsize) == -1) {
+	perror("ftruncate() output file");
+	exit(EXIT_FAILURE);
+    }
+    close(p.fdin);
+    if (close(p.fdout) == -1) {
+	perror("close()");
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < DIO_NBUF; i++) 
+	free(p.buf[i].data);
+}
+
+/*
+ * decrypt bytes [start, end) of the stream stored at file offset base, whose
+ * first byte is keystream byte stream; the context seeks straight to start so
+ * nothing before it is read or computed
+ */
+
+#define RANGE_BUFSIZE (8 << 20)
+
+static void decrypt_range(speckr_ctx *CTX, const char *in, const char *out, off_t base, uint64_t stream, 
+	uint64_t start, uint64_t end) {
+    uint8_t *buf;
+    uint64_t pos, n;
+    ssize_t ret;
+    int fd, fdout;
+
+    fd = open(in, O_RDONLY);
+    if (fd == -1) {
+	perror("open()");
+	exit(2);
+    }
+    fdout = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fdout == -1) {
+	perror("open() for writing");
+	exit(3);
+    }
+    buf = malloc(RANGE_BUFSIZE);
+    if (buf == NULL) {
+	perror("malloc()");
+	exit(EXIT_FAILURE);
+    }
+
+    for (pos = start; pos < end; pos += n) {
+	n = (pos / RANGE_BUFSIZE + 1) * RANGE_BUFSIZE - pos; // later reads start on a buffer boundary
+	if (n > end - pos) 
+	    n = end - pos;
+	if ((ret = pread(fd, buf, n, base + pos)) != (ssize_t)n) {
+	    if (ret == -1) 
+		perror("pread()");
+	    else 
+		fprintf(stderr, "short read at %llu\n", (unsigned long long)pos);
+	    exit(EXIT_FAILURE);
+	}
+	speckr_crypt_range(CTX, stream + pos, buf, buf, n);
+	if (write(fdout, buf, n) != (ssize_t)n) {
+	    perror("write()");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    free(buf);
+    close(fd);
+    if (close(fdout) == -1) {
+	perror("close()");
+	exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * stdin to stdout for pipelines: buffers are filled completely so only the last
+ * one can end in a partial block, which is padded for encryption and written
+ * without the padding, so the size never has to be known.
+ *
+ * When stdout is a pipe the ciphertext pages are vmsplice()d into it with
+ * SPLICE_F_GIFT instead of copied. The pipe, and whatever the reader splices
+ * them on to (a file, a socket, tee), may reference those pages for as long as
+ * it likes; no amount of later writes says they are free again. So every
+ * spliced buffer is a fresh mapping that is gifted and unmapped, never
+ * written again: the kernel keeps the pages alive until the last reference
+ * goes. Anything vmsplice() won't take falls back to write() from a buffer
+ * that is reused.
+ */
+
+#define PIPE_BUFSIZE (4 << 20)
+#define PIPE_WANTSIZE (1 << 20) // the default /proc/sys/fs/pipe-max-size
+
+static size_t read_full(int fd, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    ssize_t ret;
+
+    while (got < len) {
+	ret = read(fd, buf + got, len - got);
+	if (ret == 0) 
+	    break;
+	if (ret == -1) {
+	    if (errno == EINTR) 
+		continue;
+	    perror("read()");
+	    exit(EXIT_FAILURE);
+	}
+	got += ret;
+    }
+    return got;
+}
+
+/* returns 1 if any of buf was spliced, then buf must not be written again */
+static int write_full(int fd, const uint8_t *buf, size_t len, int *use_splice) {
+    struct iovec iov;
+    ssize_t ret;
+    int spliced = 0;
+
+    while (len > 0) {
+	if (*use_splice) {
+	    iov.iov_base = (void *)buf;
+	    iov.iov_len = len;
+	    ret = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+	    if (ret == -1 && (errno == EINVAL || errno == ENOSYS)) {
+		*use_splice = 0;
+		continue;
+	    }
+	} else 
+	    ret = write(fd, buf, len);
+	if (ret == -1) {
+	    if (errno == EINTR) 
+		continue;
+	    perror(*use_splice ? "vmsplice()" : "write()");
+	    exit(EXIT_FAILURE);
+	}
+	spliced |= *use_splice;
+	buf += ret;
+	len -= ret;
+    }
+    return spliced;
+}
+
+static uint8_t *pipe_buf(void) {
+    uint8_t *buf = mmap(NULL, PIPE_BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (buf == MAP_FAILED) {
+	perror("mmap()");
+	exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+static void encrypt_pipe(speckr_ctx *CTX, int nthreads) {
+    struct stat st;
+    uint8_t *buf = NULL;
+    size_t len, nblocks;
+    int use_splice = 0;
+
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode)) {
+	fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_WANTSIZE); // a smaller pipe is fine too
+	use_splice = 1;
+    }
+
+    for (;;) {
+	if (buf == NULL) 
+	    buf = pipe_buf();
+	len = read_full(STDIN_FILENO, buf, PIPE_BUFSIZE);
+	if (len == 0) 
+	    break;
+	nblocks = (len + 7) / 8;
+	memset(buf + len, 0, 8 * nblocks - len);
+	if (speckr_encrypt_parallel((uint32_t *)buf, (uint32_t *)buf, nblocks, CTX, nthreads) == -1) {
+	    perror("speckr_encrypt_parallel()");
+	    exit(EXIT_FAILURE);
+	}
+	if (write_full(STDOUT_FILENO, buf, len, &use_splice)) { /* gifted, the pipe owns these pages now */
+	    munmap(buf, PIPE_BUFSIZE);
+	    buf = NULL;
+	}
+	if (len < PIPE_BUFSIZE) 
+	    break;
+    }
+
+    if (buf != NULL) 
+	munmap(buf, PIPE_BUFSIZE);
+}
+
+/*
+ * Batch mode (-b): a directory tree or a list of files, one key derivation for
+ * all of them. Every input becomes a container under outdir; file i starts at
+ * stream block offset[i], the block count of the files before it, so the files
+ * share the key but never a part of its keystream. -b -x reads the offsets
+ * back from the headers.
+ *
+ * The files are cut into items of CONTAINER_CHUNK bytes (at least one per
+ * file) and the items are spread over the threads like the chunks of
+ * speckr_encrypt_parallel(): each thread takes from the front of its own range
+ * and steals from the back of the others', so a few huge files keep every
+ * thread busy as well as 50k small ones. Threads open, read, encrypt and write
+ * their items themselves; a failed file is reported and skipped.
+ */
+
+struct batch_file {
+    char *in, *out;
+    uint64_t len;          // bytes to encrypt, the plaintext length
+    uint64_t offset;       // stream block of the first byte
+    uint64_t first;        // its first item
+    uint32_t left;         // items not finished yet
+    int err;               // errno of the first failure, 0 if none
+    const char *what;      // and what failed
+};
+
+struct batch_deque {
+    uint64_t range;        // lo << 32 | hi, item indices
+    char pad[64 - sizeof(uint64_t)];
+};
+
+struct batch {
+    struct batch_file *f;
+    size_t nfiles, cap, skipped;
+    uint64_t nitems;
+    int extract;
+    container_hdr hdr;     // KDF parameters of every file
+    const speckr_ctx *CTX; // the key, at block 0
+    struct batch_deque *dq;
+    int nworkers;
+};
+
+struct batch_worker {
+    struct batch *b;
+    int id;
+    speckr_ctx CTX;
+    uint32_t *buf;
+    speckr_stats st;
+};
+
+#define BATCH_RANGE(lo, hi) ((uint64_t)(lo) << 32 | (uint32_t)(hi))
+#define BATCH_LO(r) ((uint32_t)((r) >> 32))
+#define BATCH_HI(r) ((uint32_t)(r))
+
+static int batch_pop(struct batch_deque *d, uint32_t *item, int back) {
+    uint64_t r = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
+
+    while (BATCH_LO(r) < BATCH_HI(r)) {
+	uint64_t next = back ? BATCH_RANGE(BATCH_LO(r), BATCH_HI(r) - 1) : BATCH_RANGE(BATCH_LO(r) + 1, BATCH_HI(r));
+
+	if (__atomic_compare_exchange_n(&d->range, &r, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    *item = back ? BATCH_HI(r) - 1 : BATCH_LO(r);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* mkdir -p of the directories in path before its last component */
+static int mkdir_parents(const char *path) {
+    char dir[4096];
+    char *p;
+
+    if (strlen(path) >= sizeof(dir)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    strcpy(dir, path);
+    for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+	*p = '\0';
+	if (mkdir(dir, 0777) == -1 && errno != EEXIST) 
+	    return -1;
+	*p = '/';
+    }
+    return 0;
+}
+
+static void batch_fail(struct batch_file *f, const char *what, int err) {
+    int none = 0;
+
+    if (__atomic_compare_exchange_n(&f->err, &none, err, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) 
+	f->what = what;
+}
+
+/*
+ * adds in as outdir/rel; with -x only containers made with the key of the
+ * first one, anything else is reported and left out
+ */
+static void batch_add(struct batch *b, const char *outdir, const char *in, const char *rel, off_t fsize) {
+    struct batch_file *f;
+    uint8_t buf[CONTAINER_HDRLEN];
+    container_hdr hdr;
+    const char *err = NULL;
+    ssize_t ret = -1;
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.len = fsize;
+    if (b->extract) {
+	memset(buf, 0, sizeof(buf));
+	if ((fd = open(in, O_RDONLY)) != -1) {
+	    ret = pread(fd, buf, CONTAINER_HDRLEN, 0);
+	    close(fd);
+	}
+	if (ret == -1) 
+	    err = strerror(errno);
+	else if ((err = container_parse(buf, fsize, &hdr)) == NULL && b->nfiles == 0) 
+	    b->hdr = hdr;
+	else if (err == NULL && (hdr.kdf.profile != b->hdr.kdf.profile || hdr.kdf.t_cost != b->hdr.kdf.t_cost || 
+		    hdr.kdf.m_cost != b->hdr.kdf.m_cost || hdr.kdf.parallelism != b->hdr.kdf.parallelism || 
+		    memcmp(hdr.kdf.salt, b->hdr.kdf.salt, SPECKR_SALTLEN) != 0)) 
+	    err = "encrypted with another key than the first container";
+	if (err != NULL) {
+	    fprintf(stderr, "%s: %s, skipped\n", in, err);
+	    b->skipped++;
+	    return;
+	}
+	if (hdr.flags & CONTAINER_F_BLAKE3) 
+	    fprintf(stderr, "%s: BLAKE3 trailer not checked in batch mode\n", in);
+    }
+
+    if (b->nfiles == b->cap) {
+	b->cap = b->cap ? 2 * b->cap : 1024;
+	b->f = realloc(b->f, b->cap * sizeof(*b->f));
+	if (b->f == NULL) {
+	    perror("realloc()");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    f = &b->f[b->nfiles++];
+    memset(f, 0, sizeof(*f));
+    f->len = hdr.len;
+    f->offset = hdr.offset; // -x; without it the stream is laid out in batch_run()
+    f->in = strdup(in);
+    f->out = malloc(strlen(outdir) + strlen(rel) + 2);
+    if (f->in == NULL || f->out == NULL) {
+	perror("malloc()");
+	exit(EXIT_FAILURE);
+    }
+    sprintf(f->out, "%s/%s", outdir, rel);
+}
+
+/* nftw() has no user pointer */
+static struct batch *walk_batch;
+static const char *walk_outdir;
+static size_t walk_rootlen;
+static struct stat walk_outst;
+
+static int batch_walk(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    const char *rel = path + walk_rootlen;
+    char *out;
+
+    while (*rel == '/') 
+	rel++;
+    if (type == FTW_D && st->st_dev == walk_outst.st_dev && st->st_ino == walk_outst.st_ino) 
+	return FTW_SKIP_SUBTREE; // outdir inside the input tree
+    if (type == FTW_D && ftw->level > 0) {
+	out = malloc(strlen(walk_outdir) + strlen(rel) + 2);
+	if (out == NULL) {
+	    perror("malloc()");
+	    exit(EXIT_FAILURE);
+	}
+	sprintf(out, "%s/%s", walk_outdir, rel);
+	if (mkdir(out, 0777) == -1 && errno != EEXIST) {
+	    fprintf(stderr, "%s: %s, subtree skipped\n", out, strerror(errno));
+	    free(out);
+	    return FTW_SKIP_SUBTREE;
+	}
+	free(out);
+    } else if (type == FTW_DNR || type == FTW_NS) 
+	fprintf(stderr, "%s: cannot be read, skipped\n", path);
+    else if (type == FTW_F && S_ISREG(st->st_mode)) 
+	batch_add(walk_batch, walk_outdir, path, rel, st->st_size);
+    return FTW_CONTINUE;
+}
+
+/*
+ * the files of a directory tree, or of a list file with one path per line;
+ * listed paths keep their relative part under outdir and may not contain ".."
+ */
+static void batch_scan(struct batch *b, const char *input, const char *outdir, int extract) {
+    struct stat st;
+    char *line = NULL, *rel, *p;
+    size_t cap = 0;
+    ssize_t n;
+    FILE *fp;
+
+    memset(b, 0, sizeof(*b));
+    b->extract = extract;
+    if (mkdir(outdir, 0777) == -1 && errno != EEXIST) {
+	perror("mkdir() output directory");
+	exit(3);
+    }
+    if (stat(input, &st) == -1 || stat(outdir, &walk_outst) == -1) {
+	perror("stat()");
+	exit(2);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+	walk_batch = b;
+	walk_outdir = outdir;
+	walk_rootlen = strlen(input);
+	if (nftw(input, batch_walk, 64, FTW_PHYS | FTW_ACTIONRETVAL) == -1) {
+	    perror("nftw()");
+	    exit(2);
+	}
+	return;
+    }
+
+    fp = fopen(input, "r");
+    if (fp == NULL) {
+	perror("fopen() file list");
+	exit(2);
+    }
+    while ((n = getline(&line, &cap, fp)) != -1) {
+	if (n > 0 && line[n - 1] == '\n') 
+	    line[--n] = '\0';
+	if (n == 0) 
+	    continue;
+	for (rel = line; *rel == '/' || (rel[0] == '.' && rel[1] == '/'); ) 
+	    rel += *rel == '/' ? 1 : 2;
+	for (p = rel; p != NULL; p = strchr(p, '/')) {
+	    p += *p == '/';
+	    if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) 
+		break;
+	}
+	if (p != NULL || *rel == '\0') {
+	    fprintf(stderr, "%s: path leaves the output directory, skipped\n", line);
+	    b->skipped++;
+	} else if (stat(line, &st) == -1) {
+	    fprintf(stderr, "%s: %s, skipped\n", line, strerror(errno));
+	    b->skipped++;
+	} else if (!S_ISREG(st.st_mode)) {
+	    fprintf(stderr, "%s: not a regular file, skipped\n", line);
+	    b->skipped++;
+	} else {
+	    n = b->nfiles;
+	    batch_add(b, outdir, line, rel, st.st_size);
+	    if ((size_t)n < b->nfiles && mkdir_parents(b->f[n].out) == -1) {
+		fprintf(stderr, "%s: %s, skipped\n", b->f[n].out, strerror(errno));
+		b->nfiles--;
+		b->skipped++;
+	    }
+	}
+    }
+    free(line);
+    fclose(fp);
+}
+
+static int batch_io(int fd, void *buf, size_t len, off_t off, int write_it) {
+    size_t done;
+    ssize_t ret;
+
+    for (done = 0; done < len; done += ret) {
+	ret = write_it ? pwrite(fd, (uint8_t *)buf + done, len - done, off + done) : 
+		pread(fd, (uint8_t *)buf + done, len - done, off + done);
+	if (ret == 0) 
+	    errno = EIO; // the input got shorter
+	if (ret <= 0) 
+	    return -1;
+    }
+    return 0;
+}
+
+/* item k of f: read, move the worker's context to its stream block, encrypt, write */
+static void batch_item(struct batch_worker *w, struct batch_file *f, uint64_t k) {
+    struct batch *b = w->b;
+    uint64_t pos = k * CONTAINER_CHUNK, blk = f->offset + pos / 8;
+    size_t n = f->len - pos < CONTAINER_CHUNK ? f->len - pos : CONTAINER_CHUNK;
+    off_t in_off = b->extract ? CONTAINER_HDRLEN : 0, out_off = b->extract ? 0 : CONTAINER_HDRLEN;
+    uint8_t hdrbuf[CONTAINER_HDRLEN];
+    container_hdr hdr;
+    int fd, fdout;
+
+    if (__atomic_load_n(&f->err, __ATOMIC_ACQUIRE) != 0) 
+	return;
+    if ((fd = open(f->in, O_RDONLY)) == -1) {
+	batch_fail(f, "open()", errno);
+	return;
+    }
+    if (batch_io(fd, w->buf, n, in_off + pos, 0) == -1) {
+	batch_fail(f, "pread()", errno);
+	close(fd);
+	return;
+    }
+    close(fd);
+
+    if (n > 0) {
+	memset((uint8_t *)w->buf + n, 0, 8 * ((n + 7) / 8) - n);
+	if (w->CTX.blkno != blk) 
+	    speckr_seek(&w->CTX, blk);
+	SpeckREncrypt_blocks(w->buf, w->buf, (n + 7) / 8, &w->CTX);
+    }
+
+    if ((fdout = open(f->out, O_WRONLY | O_CREAT, 0666)) == -1) {
+	batch_fail(f, "open() for writing", errno);
+	return;
+    }
+    if (!b->extract && k == 0) {
+	hdr = b->hdr;
+	hdr.len = f->len;
+	hdr.offset = f->offset;
+	container_pack(hdrbuf, &hdr);
+	if (batch_io(fdout, hdrbuf, CONTAINER_HDRLEN, 0, 1) == -1) 
+	    batch_fail(f, "pwrite() header", errno);
+    }
+    if (batch_io(fdout, w->buf, n, out_off + pos, 1) == -1) 
+	batch_fail(f, "pwrite()", errno);
+    if (close(fdout) == -1) 
+	batch_fail(f, "close()", errno);
+}
+
+static void *batch_worker(void *arg) {
+    struct batch_worker *w = arg;
+    struct batch *b = w->b;
+    struct batch_file *f;
+    uint32_t item = 0;
+    size_t lo, hi, mid;
+    int i;
+
+    for (;;) {
+	if (!batch_pop(&b->dq[w->id], &item, 0)) {
+	    for (i = 1; i < b->nworkers; i++) 
+		if (batch_pop(&b->dq[(w->id + i) % b->nworkers], &item, 1)) 
+		    break;
+	    if (i == b->nworkers) 
+		break;
+	}
+	for (lo = 0, hi = b->nfiles; hi - lo > 1; ) { // the last file with first <= item
+	    mid = (lo + hi) / 2;
+	    if (b->f[mid].first <= item) 
+		lo = mid;
+	    else 
+		hi = mid;
+	}
+	f = &b->f[lo];
+	batch_item(w, f, item - f->first);
+	if (__atomic_sub_fetch(&f->left, 1, __ATOMIC_ACQ_REL) == 0 && f->err == 0 && 
+		truncate(f->out, f->len + (b->extract ? 0 : CONTAINER_HDRLEN)) == -1) // an older, longer file
+	    batch_fail(f, "truncate()", errno);
+    }
+    if (w->id != 0) 
+	speckr_stats_get(&w->st);
+    return NULL;
+}
+
+/* runs the batch on nthreads threads (<= 0: one per CPU), returns the number of failed files */
+static size_t batch_run(struct batch *b, const speckr_ctx *CTX, int nthreads) {
+    struct batch_worker *w;
+    pthread_t *tid;
+    uint64_t blocks = 0, items;
+    size_t i, failed = 0;
+    int t, started;
+
+    b->nitems = 0;
+    for (i = 0; i < b->nfiles; i++) {
+	items = (b->f[i].len + CONTAINER_CHUNK - 1) / CONTAINER_CHUNK;
+	b->f[i].first = b->nitems;
+	b->f[i].left = items ? items : 1;
+	b->nitems += b->f[i].left;
+	if (!b->extract) {
+	    b->f[i].offset = blocks;
+	    blocks += (b->f[i].len + 7) / 8;
+	}
+    }
+    if (b->nitems > UINT32_MAX) {
+	fprintf(stderr, "too many items in one batch, split it\n");
+	exit(EXIT_FAILURE);
+    }
+    if (nthreads <= 0) 
+	nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if ((uint64_t)nthreads > b->nitems) 
+	nthreads = b->nitems ? (int)b->nitems : 1;
+
+    b->CTX = CTX;
+    b->nworkers = nthreads;
+    b->dq = aligned_alloc(64, nthreads * sizeof(*b->dq));
+    w = calloc(nthreads, sizeof(*w));
+    tid = calloc(nthreads, sizeof(*tid));
+    if (b->dq == NULL || w == NULL || tid == NULL) {
+	perror("malloc()");
+	exit(EXIT_FAILURE);
+    }
+    for (t = 0; t < nthreads; t++) {
+	b->dq[t].range = BATCH_RANGE(b->nitems * t / nthreads, b->nitems * (t + 1) / nthreads);
+	w[t].b = b;
+	w[t].id = t;
+	speckr_ctx_dup(&w[t].CTX, (speckr_ctx *)CTX);
+	if (posix_memalign((void **)&w[t].buf, 64, CONTAINER_CHUNK) != 0) {
+	    fprintf(stderr, "posix_memalign() failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    for (started = 1; started < nthreads; started++) // the others steal the items of threads that fail to start
+	if (pthread_create(&tid[started], NULL, batch_worker, &w[started]) != 0) 
+	    break;
+    batch_worker(&w[0]);
+    for (t = 1; t < started; t++) {
+	pthread_join(tid[t], NULL);
+	speckr_stats_add(&w[t].st);
+    }
+
+    for (i = 0; i < b->nfiles; i++) 
+	if (b->f[i].err != 0) {
+	    fprintf(stderr, "%s: %s: %s\n", b->f[i].in, b->f[i].what, strerror(b->f[i].err));
+	    unlink(b->f[i].out);
+	    failed++;
+	}
+    for (t = 0; t < nthreads; t++) 
+	free(w[t].buf);
+    free(w);
+    free(tid);
+    free(b->dq);
+    return failed;
+}
+
 int main(int argc, char *argv[]) {
     struct termios original,noecho;
     struct stat statbuf;
     speckr_ctx CTX;
-    uint32_t pt[2], ct[2];
     char passwd[MAXPWDLEN];
     size_t pwdlen;
     off_t fsize;
-    FILE *fp, *fpout;
-    int ret;
+    speckr_kdf_params kdf;
+    container_hdr hdr;
+    uint8_t hdrbuf[CONTAINER_HDRLEN], digest[BLAKE3_OUT_LEN], stored[BLAKE3_OUT_LEN];
+    blake3_hasher hasher, *h = NULL;
+    int opt, use_mmap = 0, inplace = 0, direct = 0, nthreads = 0, profile = SPECKR_KDF_V1;
+    int create = 0, extract = 0, range = 0, pipe_mode = 0, hash = 0, stats = 0, batch = 0;
+    struct batch b;
+    size_t failed = 0;
+    struct timespec ts0, ts1;
+    FILE *tty_in = stdin, *tty_out = stdout;
+    uint64_t start = 0, end = UINT64_MAX;
+    char *sep;
 
-    if (argc < 3) {
-	fprintf(stderr, "Usage: %s input-filename output-filename\n", argv[0]);
+    while ((opt = getopt(argc, argv, "midcxpbHSt:k:r:")) != -1) {
+	switch (opt) {
+	case 'm': use_mmap = 1; break;
+	case 'c': create = 1; break;
+	case 'x': extract = 1; break;
+	case 'p': pipe_mode = 1; break;
+	case 'b': batch = 1; break;
+	case 'H': hash = 1; break;
+	case 'S': stats = 1; break;
+	case 'r': 
+	    range = 1;
+	    start = strtoull(optarg, &sep, 0);
+	    if (*sep != ':') {
+		usage(argv[0]);
+		return 1;
+	    }
+	    if (sep[1] != '\0') 
+		end = strtoull(sep + 1, NULL, 0);
+	    break;
+	case 'd': direct = 1; break;
+	case 'i': inplace = 1; break;
+	case 't': nthreads = atoi(optarg); break;
+	case 'k': /* only profiles -x can read back */
+	    profile = strtol(optarg, &sep, 10);
+	    if (*sep != '\0' || (profile != SPECKR_KDF_V1 && profile != SPECKR_KDF_V2)) {
+		fprintf(stderr, "unsupported KDF profile %s\n", optarg);
+		usage(argv[0]);
+		return 1;
+	    }
+	    break;
+	default: usage(argv[0]); return 1;
+	}
+    }
+
+    if (argc - optind < (pipe_mode ? 0 : inplace ? 1 : 2) || (inplace && (create || extract || range)) || 
+	    (create && (extract || range)) || (pipe_mode && (inplace || create || extract || range)) || 
+	    (hash && (pipe_mode || range)) || (batch && (inplace || create || range || pipe_mode || hash || use_mmap || direct))) {
+	usage(argv[0]);
 	return 0;
     }
 
-    if (stat(argv[1], &statbuf) == -1) {
+    if (pipe_mode) { /* stdin carries the data, ask the terminal; stdout carries the ciphertext */
+	tty_in = tty_out = fopen("/dev/tty", "r+");
+	if (tty_in == NULL) {
+	    perror("fopen() /dev/tty");
+	    return 1;
+	}
+	fsize = 0;
+    } else if (batch) {
+	batch_scan(&b, argv[optind], argv[optind + 1], extract);
+	if (extract && b.nfiles == 0) {
+	    fprintf(stderr, "no containers to decrypt\n");
+	    return 5;
+	}
+	hdr = b.hdr;
+	fsize = 0;
+    } else {
+	if (stat(argv[optind], &statbuf) == -1) {
 	    perror("stat()");
 	    return 1;
-    }
+	}
 
-    /* get original filesize */
+	/* get original filesize */
 
-    fsize = statbuf.st_size;
+	fsize = statbuf.st_size;
+    }
+
+    if (extract && !batch) /* the KDF parameters come from the header */
+	container_read(argv[optind], fsize, &hdr);
+    if (extract && hash && !batch && !(hdr.flags & CONTAINER_F_BLAKE3)) 
+	fprintf(stderr, "%s has no BLAKE3 trailer, nothing to check\n", argv[optind]);
+    if ((hash && !extract) || (extract && !range && (hdr.flags & CONTAINER_F_BLAKE3))) {
+	blake3_hasher_init(&hasher);
+	h = &hasher;
+    }
 
     /* read password without printing echo bytes on screen */
 
-    tcgetattr(STDIN_FILENO,&original);
+    tcgetattr(fileno(tty_in),&original);
     noecho = original;
     noecho.c_lflag = noecho.c_lflag ^ ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &noecho);
-    printf("Password: ");
-    fgets(passwd, MAXPWDLEN, stdin);
-    fprintf(stdout, "\n");
+    tcsetattr(fileno(tty_in), TCSANOW, &noecho);
+    fprintf(tty_out, "Password: ");
+    fflush(tty_out);
+    fgets(passwd, MAXPWDLEN, tty_in);
+    fprintf(tty_out, "\n");
     pwdlen = strlen(passwd);
     passwd[pwdlen-1] = '\0';
-    tcsetattr(STDIN_FILENO, TCSANOW, &original);
+    tcsetattr(fileno(tty_in), TCSANOW, &original);
 
     /* maybe we should read the password twice and compare, add checksum for original */
 
@@ -108,58 +1322,75 @@ int main(int argc, char *argv[]) {
      * this stuff is stored in the speckr context "CTX" object including the expanded key
      */
 
-    speckr_init(&CTX, passwd);
-    
-    fpout = fopen(argv[2], "w");
-    if (fpout == NULL) {
-	    perror("fopen() for writing");
-	    return 3;
+    if (stats) 
+	speckr_stats_enable(1);
+    if (speckr_kdf_defaults(&kdf, profile) != 0) {
+	fprintf(stderr, "unsupported KDF profile %d\n", profile);
+	return 4;
     }
-    /*
-     *  open file for reading and writing 
-     */
-
-    fp = fopen(argv[1], "rb+");
-    if (fp == NULL) {
-	perror("fopen()");
-	return 2;
+    if (extract) {
+	kdf = hdr.kdf;
+    } else if ((create || batch) && getrandom(kdf.salt, SPECKR_SALTLEN, 0) != SPECKR_SALTLEN) {
+	perror("getrandom()");
+	return 4;
+    }
+    if (speckr_init_ex(&CTX, passwd, &kdf) != 0) {
+	fprintf(stderr, "speckr_init_ex() failed\n");
+	return 4;
     }
 
     clock_t t0 = clock();
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
 
-    /*
-     * read 64 bits, encrypt/decrypt, overwrite 64 bits
-     */
+    if (batch) {
+	b.hdr.kdf = kdf;
+	b.hdr.chunk = CONTAINER_CHUNK;
+	b.hdr.flags = CONTAINER_F_OFFSET;
+	failed = batch_run(&b, &CTX, nthreads) + b.skipped;
+    } else if (pipe_mode) 
+	encrypt_pipe(&CTX, nthreads);
+    else if (range) {
+	uint64_t len = extract ? hdr.len : (uint64_t)fsize;
 
-    ret=8;
-    while(ret==8) {
-       if ((ret=fread(pt, 1, 8, fp))==0) { // read 64 bits
-	    if (ferror(fp)) {
-	            perror("fread()");
-        	    exit(EXIT_FAILURE);
-	    }
-        }
-
-       SpeckREncrypt(pt, ct, &CTX);
-
-       if (fwrite(ct, 8, 1, fpout)!=1) { /* overwrite 64 bits of ciphertext */
-            perror("fwrite()");
-            exit(EXIT_FAILURE);
-        }
+	if (end > len) 
+	    end = len;
+	decrypt_range(&CTX, argv[optind], argv[optind + 1], extract ? CONTAINER_HDRLEN : 0, extract ? 8 * hdr.offset : 0, 
+		start, start < end ? end : start);
+    } else if (create) {
+	hdr.kdf = kdf;
+	hdr.chunk = CONTAINER_CHUNK;
+	hdr.flags = hash ? CONTAINER_F_BLAKE3 : 0;
+	hdr.offset = 0;
+	hdr.len = fsize;
+	container_pack(hdrbuf, &hdr);
+	encrypt_mmap(&CTX, argv[optind], argv[optind + 1], 0, hdrbuf, CONTAINER_HDRLEN, fsize, nthreads, h, SPECKR_HASH_OUT);
+    } else if (extract) { /* the trailer covers the ciphertext, which is the input here */
+	if (hdr.offset != 0) /* written by -b */
+	    speckr_seek(&CTX, hdr.offset);
+	encrypt_mmap(&CTX, argv[optind], argv[optind + 1], CONTAINER_HDRLEN, NULL, 0, hdr.len, nthreads, h, SPECKR_HASH_IN);
+    } else if (inplace) 
+	encrypt_mmap(&CTX, argv[optind], NULL, 0, NULL, 0, fsize, nthreads, h, SPECKR_HASH_OUT);
+    else if (use_mmap) 
+	encrypt_mmap(&CTX, argv[optind], argv[optind + 1], 0, NULL, 0, fsize, nthreads, h, SPECKR_HASH_OUT);
+    else if (direct) 
+	encrypt_direct(&CTX, argv[optind], argv[optind + 1], fsize, nthreads, h);
+    else 
+	encrypt_stdio(&CTX, argv[optind], argv[optind + 1], h);
 
-    }
-
-    fclose(fp); fclose(fpout);
-
-    /*
-     * if we read less than 8 bytes because filesize is not a multiple of 64 bits
-     * we need to truncate to original filesize since surplus encrypted bits are
-     * not from the original plaintext but dummy bytes
-     */
-
-    if (truncate(argv[2], fsize) == -1) {
-	perror("truncate() output file");
-	exit(EXIT_FAILURE);
+    if (h != NULL) {
+	blake3_hasher_finalize(h, digest, BLAKE3_OUT_LEN);
+	if (create) 
+	    container_digest(argv[optind + 1], hdr.len, digest, 1);
+	else if (extract) {
+	    container_digest(argv[optind], hdr.len, stored, 0);
+	    if (memcmp(digest, stored, BLAKE3_OUT_LEN) != 0) { /* no plaintext of a damaged container is left behind */
+		fprintf(stderr, "BLAKE3 mismatch: %s is damaged, %s removed\n", argv[optind], argv[optind + 1]);
+		if (unlink(argv[optind + 1]) == -1) 
+		    perror("unlink() output file");
+		return 6;
+	    }
+	} else 
+	    write_sidecar(argv[inplace ? optind : optind + 1], digest);
     }
 
     /*
@@ -167,8 +1398,15 @@ int main(int argc, char *argv[]) {
      */
 
     clock_t t1 = clock();    
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    if (stats) 
+	print_stats((uint64_t)(ts1.tv_sec - ts0.tv_sec) * 1000000000 + ts1.tv_nsec - ts0.tv_nsec);
 
-    printf("Done (%Lf)\n", (long double)(t1 - t0));
+    fprintf(tty_out, "Done (%Lf)\n", (long double)(t1 - t0));
+    if (failed) {
+	fprintf(stderr, "%zu file(s) failed\n", failed);
+	return 7;
+    }
 
     return 0;
 }
@@ -18,17 +18,24 @@
 */   
 
 #include <argon2.h> /* libargon2 */
+#include <pthread.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "speckr.h"
+#include "speckr_inline.h"
+#include "speckr_probe.h"
 
-//#include "blake3.h" for hashing the file or payload
+#include "blake3.h" // speckr_encrypt_hash()
 
 #define ARGON_HASHLEN 32
-#define ARGON_SALTLEN 16
+#define ARGON_SALTLEN SPECKR_SALTLEN
+#define ARGON_V2_OUTLEN (12 + 3 * 12) // key and three KSA seeds
 
 /* 
  * RC4D_KSA is from https://link.springer.com/chapter/10.1007/978-3-030-64758-2_2
@@ -79,29 +86,212 @@ void split_uint64_to_uint32(uint64_t input, uint32_t *low, uint32_t *high) {
 }
 
 
-void speckr_init(speckr_ctx *CTX, const char *password) {
-    int i;
-    uint8_t *pwd = (uint8_t *)password;
-    uint32_t pwdlen;
+int speckr_kdf_defaults(speckr_kdf_params *params, int profile) {
+    if (profile != SPECKR_KDF_V1 && profile != SPECKR_KDF_V2) 
+        return -1;
+    params->profile = profile;
+    params->t_cost = 20;           // 2-pass computation
+    params->m_cost = (1<<16);      // 64 mebibytes memory usage
+    params->parallelism = profile == SPECKR_KDF_V2 ? 4 : 1; // lanes, part of the derived key
+    params->threads = 0;
+    memset(params->salt, 0, SPECKR_SALTLEN); // all-zero salt of the original raw format
+    return 0;
+}
+
+/*
+ *  Statistics cost one relaxed load and a predicted branch per call while off
+ *  (per block in SpeckREncrypt()); the counters are thread local, no atomics.
+ */
+static int speckr_stats_on;
+static __thread speckr_stats speckr_tls;
+
+#define SPECKR_COUNT(field, n) do { \
+    if (__builtin_expect(__atomic_load_n(&speckr_stats_on, __ATOMIC_RELAXED), 0)) \
+        speckr_tls.field += (n); \
+} while (0)
+
+void speckr_stats_enable(int on) {
+    __atomic_store_n(&speckr_stats_on, on != 0, __ATOMIC_RELAXED);
+}
+
+void speckr_stats_get(speckr_stats *st) {
+    *st = speckr_tls;
+}
+
+void speckr_stats_reset(void) {
+    memset(&speckr_tls, 0, sizeof(speckr_tls));
+}
+
+void speckr_stats_add(const speckr_stats *st) {
+    const uint64_t *src = (const uint64_t *)st; // every field is a uint64_t
+    uint64_t *dst = (uint64_t *)&speckr_tls;
+    size_t i;
+
+    for (i = 0; i < sizeof(*st) / sizeof(uint64_t); i++) 
+        dst[i] += src[i];
+}
+
+static uint64_t speckr_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Argon2 working memory comes from one library-wide arena that is kept between
+ * passes and between speckr_init() calls, so the 64 MiB are faulted in once
+ * instead of three times per init. It is zeroed whenever argon2 hands it back.
+ * A second concurrent init finds the arena busy and falls back to malloc().
+ */
+static struct {
+    pthread_mutex_t lock;
+    uint8_t *mem;
+    size_t size;
+    int busy;
+} speckr_arena = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static uint8_t *speckr_arena_map(size_t bytes, int flags) {
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *mem = MAP_FAILED;
+
+    if (flags & SPECKR_ARENA_PREFAULT) 
+        mflags |= MAP_POPULATE;
+#ifdef MAP_HUGETLB
+    if (flags & SPECKR_ARENA_HUGE) // needs reserved huge pages, else transparent ones below
+        mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+#endif
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        if (mem == MAP_FAILED) 
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (flags & SPECKR_ARENA_HUGE) 
+            madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    return mem;
+}
+
+int speckr_arena_reserve(size_t bytes, int flags) {
+    uint8_t *mem;
+    int ret = -1;
+
+    pthread_mutex_lock(&speckr_arena.lock);
+    if (!speckr_arena.busy) {
+        if (speckr_arena.mem != NULL && speckr_arena.size >= bytes) {
+            ret = 0;
+        } else if ((mem = speckr_arena_map(bytes, flags)) != NULL) {
+            if (speckr_arena.mem != NULL) 
+                munmap(speckr_arena.mem, speckr_arena.size);
+            speckr_arena.mem = mem;
+            speckr_arena.size = bytes;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&speckr_arena.lock);
+    return ret;
+}
+
+void speckr_arena_release(void) {
+    pthread_mutex_lock(&speckr_arena.lock);
+    if (!speckr_arena.busy && speckr_arena.mem != NULL) {
+        munmap(speckr_arena.mem, speckr_arena.size);
+        speckr_arena.mem = NULL;
+        speckr_arena.size = 0;
+    }
+    pthread_mutex_unlock(&speckr_arena.lock);
+}
+
+static int speckr_arena_alloc(uint8_t **memory, size_t bytes) {
+    uint8_t *mem;
+
+    pthread_mutex_lock(&speckr_arena.lock);
+    if (!speckr_arena.busy && speckr_arena.size < bytes) { // first use or grown m_cost
+        if ((mem = speckr_arena_map(bytes, 0)) != NULL) {
+            if (speckr_arena.mem != NULL) 
+                munmap(speckr_arena.mem, speckr_arena.size);
+            speckr_arena.mem = mem;
+            speckr_arena.size = bytes;
+        }
+    }
+    if (!speckr_arena.busy && speckr_arena.size >= bytes) {
+        speckr_arena.busy = 1;
+        *memory = speckr_arena.mem;
+        pthread_mutex_unlock(&speckr_arena.lock);
+        return ARGON2_OK;
+    }
+    pthread_mutex_unlock(&speckr_arena.lock);
+
+    *memory = malloc(bytes);
+    return *memory == NULL ? ARGON2_MEMORY_ALLOCATION_ERROR : ARGON2_OK;
+}
+
+/* memset through a volatile pointer so the wipe before free() is not optimized away */
+static void *(*const volatile speckr_wipe)(void *, int, size_t) = memset;
+
+static void speckr_arena_free(uint8_t *memory, size_t bytes) {
+    speckr_wipe(memory, 0, bytes);
+    pthread_mutex_lock(&speckr_arena.lock);
+    if (memory == speckr_arena.mem) {
+        speckr_arena.busy = 0;
+        pthread_mutex_unlock(&speckr_arena.lock);
+        return;
+    }
+    pthread_mutex_unlock(&speckr_arena.lock);
+    free(memory);
+}
+
+/*
+ * argon2i over the arena: the output equals argon2i_hash_raw() with the same t_cost,
+ * m_cost and lanes, whatever the thread count; pass is for the stats
+ */
+static int speckr_argon2i(speckr_ctx *CTX, int pass, uint32_t threads, const uint8_t *in, uint32_t inlen, 
+        const uint8_t *salt, uint8_t *out, uint32_t outlen) {
+    argon2_context ctx;
+    uint8_t buf[ARGON_V2_OUTLEN];
+    uint64_t t0;
+    int ret;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out = buf; // in and out may be the same buffer
+    ctx.outlen = outlen;
+    ctx.pwd = (uint8_t *)in;
+    ctx.pwdlen = inlen;
+    ctx.salt = (uint8_t *)salt;
+    ctx.saltlen = ARGON_SALTLEN;
+    ctx.t_cost = CTX->t_cost;
+    ctx.m_cost = CTX->m_cost;
+    ctx.lanes = CTX->parallelism;
+    ctx.threads = threads;
+    ctx.version = ARGON2_VERSION_NUMBER;
+    ctx.allocate_cbk = speckr_arena_alloc;
+    ctx.free_cbk = speckr_arena_free;
+    ctx.flags = ARGON2_DEFAULT_FLAGS;
+
+    t0 = speckr_now_ns();
+    ret = argon2_ctx(&ctx, Argon2_i);
+    t0 = speckr_now_ns() - t0;
+    SPECKR_COUNT(kdf_ns[pass], t0);
+    SPECKR_PROBE2(kdf_pass, pass, t0);
+    memcpy(out, buf, outlen);
+    memset(buf, 0, sizeof(buf));
+    return ret;
+}
+
+/*
+ * KDF v1: three chained argon2i passes, hash[0..11] is the key and hash[12..23] of
+ * each pass seeds Sbox1, Sbox2 and Sbox3
+ */
+static int speckr_kdf_v1(speckr_ctx *CTX, const uint8_t *pwd, uint32_t pwdlen, const uint8_t *salt) {
     uint32_t derived_key[3];
     uint8_t hash[ARGON_HASHLEN];
-    uint8_t salt[ARGON_SALTLEN];
     uint8_t K[12]; 
+    int i, ret;
 
-    CTX->NL = 0; 
-    CTX->NR = 0; 
-    CTX->it1 = 0; 
-    CTX->it2 = 0; 
-    CTX->loop = 0; 
-
-    memset(salt, 0x00, ARGON_SALTLEN);
-    pwdlen = strlen((char *)pwd); 
-
-    CTX->t_cost = 20;           // 2-pass computation
-    CTX->m_cost = (1<<16);      // 64 mebibytes memory usage
-    CTX->parallelism = 1;       // number of threads and lanes
-			   
-    argon2i_hash_raw(CTX->t_cost, CTX->m_cost, CTX->parallelism, pwd, pwdlen, salt, ARGON_SALTLEN, hash, ARGON_HASHLEN);
+    /* each pass hashes the previous output, stop at the first argon2 error */
+    if ((ret = speckr_argon2i(CTX, 0, CTX->parallelism, pwd, pwdlen, salt, hash, ARGON_HASHLEN)) != ARGON2_OK) 
+        return ret;
     copy_bytes_to_uint32(hash, derived_key, 3); // 3 * 32 = 96 bits
 
     SpeckRKeySchedule(derived_key, CTX->derived_key_r);
@@ -109,90 +299,214 @@ void speckr_init(speckr_ctx *CTX, const char *password) {
     for (i=0;i<12;i++) K[i]=hash[i+12];
     RC4D_KSA(K, 12, CTX->Sbox1);
 
-    argon2i_hash_raw(CTX->t_cost, CTX->m_cost, CTX->parallelism, hash, ARGON_HASHLEN, salt, ARGON_SALTLEN, hash, ARGON_HASHLEN);
+    if ((ret = speckr_argon2i(CTX, 1, CTX->parallelism, hash, ARGON_HASHLEN, salt, hash, ARGON_HASHLEN)) != ARGON2_OK) 
+        return ret;
 
     for (i=0;i<12;i++) K[i]=hash[i+12];
     RC4D_KSA(K, 12, CTX->Sbox2);
 
-    argon2i_hash_raw(CTX->t_cost, CTX->m_cost, CTX->parallelism, hash, ARGON_HASHLEN, salt, ARGON_SALTLEN, hash, ARGON_HASHLEN);
+    if ((ret = speckr_argon2i(CTX, 2, CTX->parallelism, hash, ARGON_HASHLEN, salt, hash, ARGON_HASHLEN)) != ARGON2_OK) 
+        return ret;
 
     for (i=0;i<12;i++) K[i]=hash[i+12];
     RC4D_KSA(K, 12, CTX->Sbox3);
+
+    return ARGON2_OK;
 }
 
-/* copy CTX2 into CTX1 */
-void speckr_ctx_dup(speckr_ctx *CTX1, speckr_ctx *CTX2) {
-    int i;
+/*
+ * KDF v2: one multi-lane argon2i call with a 48 byte output,
+ * out[0..11] is the key and out[12..23], out[24..35], out[36..47] seed the Sboxes
+ */
+static int speckr_kdf_v2(speckr_ctx *CTX, const uint8_t *pwd, uint32_t pwdlen, const uint8_t *salt, uint32_t threads) {
+    uint32_t derived_key[3];
+    uint8_t out[ARGON_V2_OUTLEN];
+    long ncpu;
+    int ret;
 
-    CTX1->NL = CTX2->NL; 
-    CTX1->NR = CTX2->NR; 
-    CTX1->it1 = CTX2->it1; 
-    CTX1->it2 = CTX2->it2; 
-    CTX1->loop = CTX2->loop;
-    CTX1->t_cost = CTX2->t_cost;      // 2-pass computation
-    CTX1->m_cost = CTX2->m_cost;      // 64 mebibytes memory usage
-    CTX1->parallelism = CTX2->parallelism; // number of threads and lanes
-    for (i=0;i<256;i++) CTX1->Sbox1[i] = CTX2->Sbox1[i];
-    for (i=0;i<256;i++) CTX1->Sbox2[i] = CTX2->Sbox2[i];
-    for (i=0;i<256;i++) CTX1->Sbox3[i] = CTX2->Sbox3[i];
-    for (i=0;i<26;i++) CTX1->derived_key_r[i] = CTX2->derived_key_r[i];
+    if (threads == 0) { // the thread count does not change the output, the lanes do
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = ncpu > 0 && (uint32_t)ncpu < CTX->parallelism ? (uint32_t)ncpu : CTX->parallelism;
+    }
+
+    if ((ret = speckr_argon2i(CTX, 0, threads, pwd, pwdlen, salt, out, ARGON_V2_OUTLEN)) != ARGON2_OK) 
+        return ret;
+
+    copy_bytes_to_uint32(out, derived_key, 3);
+    SpeckRKeySchedule(derived_key, CTX->derived_key_r);
+    RC4D_KSA(out + 12, 12, CTX->Sbox1);
+    RC4D_KSA(out + 24, 12, CTX->Sbox2);
+    RC4D_KSA(out + 36, 12, CTX->Sbox3);
+    memset(out, 0, sizeof(out));
+
+    return ret;
 }
 
-void speckr_reset_ctr(speckr_ctx *CTX) {
+int speckr_init_ex(speckr_ctx *CTX, const char *password, const speckr_kdf_params *params) {
+    uint8_t *pwd = (uint8_t *)password;
+    uint32_t pwdlen;
+    const uint8_t *salt = params->salt;
+    int ret;
+
+    if (params->profile != SPECKR_KDF_V1 && params->profile != SPECKR_KDF_V2) 
+        return ARGON2_INCORRECT_TYPE; // nothing derived, CTX untouched
+
     CTX->NL = 0; 
     CTX->NR = 0; 
     CTX->it1 = 0; 
     CTX->it2 = 0; 
     CTX->loop = 0; 
+    CTX->blkno = 0; 
+    CTX->ks_avail = 0; 
+
+    SPECKR_PROBE1(init_start, params->profile);
+    SPECKR_COUNT(kdf_calls, 1);
+    speckr_dispatch_init();
+
+    pwdlen = strlen((char *)pwd); 
+
+    CTX->kdf = params->profile;
+    CTX->t_cost = params->t_cost;
+    CTX->m_cost = params->m_cost;
+    CTX->parallelism = params->parallelism;
+
+    if (params->profile == SPECKR_KDF_V2) 
+        ret = speckr_kdf_v2(CTX, pwd, pwdlen, salt, params->threads);
+    else // SPECKR_KDF_V1
+        ret = speckr_kdf_v1(CTX, pwd, pwdlen, salt);
+
+    memcpy(CTX->Sbox1_0, CTX->Sbox1, 256);
+    memcpy(CTX->Sbox2_0, CTX->Sbox2, 256);
+
+    SPECKR_PROBE2(init_done, params->profile, ret);
+    return ret;
 }
 
-void SpeckREncrypt(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX) { 
-    uint32_t i, aux;
-    uint32_t x, y;
-    uint32_t wbuf[2];
-
-    x = CTX->NL; 
-    y = CTX->NR;
-    wbuf[1] = x; 
-    wbuf[0] = y;
-
-    Ct[0] = (wbuf[0] << 24) | (wbuf[0] >> 24) | ((wbuf[0] << 8) & 0xFF0000) | ((wbuf[0] >> 8) & 0xFF00); // y
-    Ct[1] = (wbuf[1] << 24) | (wbuf[1] >> 24) | ((wbuf[1] << 8) & 0xFF0000) | ((wbuf[1] >> 8) & 0xFF00); // x
-    
-    for(i = 0; i < SPECKR_ROUNDS; i++) {
-        ER32(Ct[1], Ct[0], CTX->derived_key_r[i + CTX->loop]);
-    } // end of rounds loop
-
-    x = Ct[1]; 
-    y = Ct[0];
-    
-    aux = x; 
-    x = y; 
-    y = aux;
-
-    CTX->NR++; 
-
-    y = CTX->Sbox1[y >> 24 & 0xFF] << 24 | CTX->Sbox1[y >> 16 & 0xFF] << 16 | CTX->Sbox1[y >> 8 & 0xFF] << 8 | CTX->Sbox1[y & 0xFF];
-    Ct[0] ^= y ^ Pt[0];
-
-    x = CTX->Sbox1[x >> 24 & 0xFF] << 24 | CTX->Sbox1[x >> 16 & 0xFF] << 16 | CTX->Sbox1[x >> 8 & 0xFF] << 8 | CTX->Sbox1[x & 0xFF];
-    Ct[1] ^= x ^ Pt[1];
-
-    // Update Sbox substitution operation follows
-    CTX->it1++; 
-    CTX->it2++;
-    if (CTX->it1 == 2000) {
+void speckr_init(speckr_ctx *CTX, const char *password) {
+    speckr_kdf_params params;
+
+    speckr_kdf_defaults(&params, SPECKR_KDF_V1);
+    speckr_init_ex(CTX, password, &params);
+}
+
+/* copy CTX2 into CTX1 */
+void speckr_ctx_dup(speckr_ctx *CTX1, speckr_ctx *CTX2) {
+    *CTX1 = *CTX2;
+}
+
+/* S = A o B, S may be A or B */
+static void speckr_sbox_compose(uint8_t *S, const uint8_t *A, const uint8_t *B) {
+    uint8_t T[256];
+    int i;
+
+    for (i = 0; i < 256; i++) T[i] = A[B[i]];
+    memcpy(S, T, 256);
+}
+
+/* S = P o P o ... o P (e times) by square and multiply */
+static void speckr_sbox_pow(uint8_t *S, const uint8_t *P, uint64_t e) {
+    uint8_t Q[256];
+    int i;
+
+    for (i = 0; i < 256; i++) S[i] = i;
+    memcpy(Q, P, 256);
+    while (e) {
+        if (e & 1) 
+            speckr_sbox_compose(S, Q, S);
+        e >>= 1;
+        if (e) 
+            speckr_sbox_compose(Q, Q, Q);
+    }
+}
+
+/*
+ *  After n blocks Sbox1 was updated e = n / 2000 times and Sbox2 m = e / 2000 times.
+ *  The k-th group of 2000 Sbox1 updates uses Sbox2 = Sbox3^k o Sbox2_0, so
+ *  Sbox1 = Sbox2_m^(e % 2000) o Sbox2_(m-1)^2000 o ... o Sbox2_0^2000 o Sbox1_0
+ *
+ *  speckr_sbox_advance() moves S1, S2 from their state at block "from" to block "to" >= from.
+ */
+static void speckr_sbox_advance(uint8_t *S1, uint8_t *S2, const uint8_t *S3, uint64_t from, uint64_t to) {
+    uint64_t e = to / SPECKR_EPOCH, m = e / SPECKR_EPOCH;
+    uint64_t ec = from / SPECKR_EPOCH, mc = ec / SPECKR_EPOCH;
+    uint8_t P[256];
+
+    for (; mc < m; mc++) { // finish the current group of Sbox1 updates, then update Sbox2
+        speckr_sbox_pow(P, S2, (mc + 1) * SPECKR_EPOCH - ec);
+        speckr_sbox_compose(S1, P, S1);
+        speckr_sbox_compose(S2, S3, S2);
+        ec = (mc + 1) * SPECKR_EPOCH;
+    }
+    speckr_sbox_pow(P, S2, e - ec);
+    speckr_sbox_compose(S1, P, S1);
+}
+
+/*
+ *  Seeking forward continues from the current Sboxes, seeking backwards restarts
+ *  from Sbox1_0 and Sbox2_0.
+ */
+void speckr_seek(speckr_ctx *CTX, uint64_t block_index) {
+    uint64_t from = CTX->blkno;
+
+    if (block_index < from) {
+        memcpy(CTX->Sbox1, CTX->Sbox1_0, 256);
+        memcpy(CTX->Sbox2, CTX->Sbox2_0, 256);
+        from = 0;
+    }
+    speckr_sbox_advance(CTX->Sbox1, CTX->Sbox2, CTX->Sbox3, from, block_index);
+
+    CTX->NL = 0; // SpeckREncrypt() never carries NR into NL
+    CTX->NR = (uint32_t)block_index;
+    CTX->it1 = block_index % SPECKR_EPOCH;
+    CTX->it2 = block_index % (SPECKR_EPOCH * SPECKR_EPOCH);
+    CTX->loop = (SPECKR_ROUNDS * (block_index % (25 - SPECKR_ROUNDS))) % (25 - SPECKR_ROUNDS);
+    CTX->blkno = block_index;
+    CTX->ks_avail = 0;
+}
+
+/* also restores the initial Sboxes so a reset stream decrypts past the first epoch */
+/* also rewinds the Sboxes, unlike the original reset; see speckr.h */
+void speckr_reset_ctr(speckr_ctx *CTX) {
+    speckr_seek(CTX, 0);
+}
+
+/*
+ * Sbox1 := Sbox2 o Sbox1 every SPECKR_EPOCH blocks, Sbox2 := Sbox3 o Sbox2 every SPECKR_EPOCH^2 blocks
+ */
+void speckr__sbox_update(speckr_ctx *CTX) {
+    int i;
+
+    if (CTX->it1 == SPECKR_EPOCH) {
         for (i = 0; i < 256; i++) 
             CTX->Sbox1[i] = CTX->Sbox2[CTX->Sbox1[i]];
         CTX->it1 = 0;
-        if (CTX->it2 == 2000 * 2000) {
+        SPECKR_COUNT(sbox1_updates, 1);
+        SPECKR_PROBE1(sbox1_update, CTX->blkno);
+        if (CTX->it2 == SPECKR_EPOCH * SPECKR_EPOCH) {
             for (i = 0; i < 256; i++) 
                 CTX->Sbox2[i] = CTX->Sbox3[CTX->Sbox2[i]];
             CTX->it2 = 0;
+            SPECKR_COUNT(sbox2_updates, 1);
+            SPECKR_PROBE1(sbox2_update, CTX->blkno);
         }
     }
+}
+
+/*
+ *  The unrolled round functions speckr_rounds_L() of the 18 key windows live in
+ *  speckr_inline.h. The packet path dispatches on speckr_rounds[loop], the
+ *  scalar kernel and speckr_keystream_at() call them directly.
+ */
+static void (*const speckr_rounds[25 - SPECKR_ROUNDS])(uint32_t *, uint32_t *, const uint32_t *) = {
+    speckr_rounds_0,  speckr_rounds_1,  speckr_rounds_2,  speckr_rounds_3,  speckr_rounds_4,  speckr_rounds_5,
+    speckr_rounds_6,  speckr_rounds_7,  speckr_rounds_8,  speckr_rounds_9,  speckr_rounds_10, speckr_rounds_11,
+    speckr_rounds_12, speckr_rounds_13, speckr_rounds_14, speckr_rounds_15, speckr_rounds_16, speckr_rounds_17
+};
 
-    CTX->loop = (CTX->loop + SPECKR_ROUNDS) % (25 - SPECKR_ROUNDS);
+/* both live in speckr_inline.h, which callers can inline into their own loops */
+void SpeckREncrypt(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX) { 
+    SPECKR_COUNT(blocks, 1);
+    SpeckREncrypt_inline(Pt, Ct, CTX);
 }
 
 /*
@@ -201,55 +515,919 @@ void SpeckREncrypt(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX) {
  *  packet_no, packet_size and offset are provided by the caller and offset is incremented 8 bytes at a time (blocksize is 64 bits)
  */
 void SpeckREncrypt_async(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX, uint64_t packet_no, uint64_t packet_size, uint64_t offset) {
-    uint32_t i;
-    uint32_t x, y, aux;
-    uint32_t wbuf[2];
+    uint32_t ks[2];
     uint64_t datasize;
 
     datasize = packet_no * packet_size + 8 * offset; // 64 bits at a time
     split_uint64_to_uint32(datasize, &CTX->NR, &CTX->NL); // this is always necessary here
 
-    x = CTX->NL; 
-    y = CTX->NR;
-    wbuf[1] = x; 
-    wbuf[0] = y;
+    speckr_keystream_at(CTX, ks);
 
-    Ct[0] = (wbuf[0] << 24) | (wbuf[0] >> 24) | ((wbuf[0] << 8) & 0xFF0000) | ((wbuf[0] >> 8) & 0xFF00); // y
-    Ct[1] = (wbuf[1] << 24) | (wbuf[1] >> 24) | ((wbuf[1] << 8) & 0xFF0000) | ((wbuf[1] >> 8) & 0xFF00); // x
-    
-    for(i = 0; i < SPECKR_ROUNDS; i++) {
-        ER32(Ct[1], Ct[0], CTX->derived_key_r[i + CTX->loop]);
-    } // end of rounds loop  
+    // no need to increment CTX->NR because the next value is deduced from given parameters for packet_no, size and offset
 
-    x = Ct[1]; 
-    y = Ct[0];
+    Ct[0] = Pt[0] ^ ks[0];
+    Ct[1] = Pt[1] ^ ks[1];
 
-    aux = x; // the swap can be done because first_call_in_packet resets the counters
-    x = y;
-    y = aux;
+    SPECKR_COUNT(blocks, 1);
+    speckr_next_inline(CTX);
+}
 
-    // no need to increment CTX->NR because the next value is deduced from given parameters for packet_no, size and offset
+static inline uint32_t speckr_bswap32(uint32_t w) {
+    return (w << 24) | (w >> 24) | ((w << 8) & 0xFF0000) | ((w >> 8) & 0xFF00);
+}
 
-    y = CTX->Sbox1[y >> 24 & 0xFF] << 24 | CTX->Sbox1[y >> 16 & 0xFF] << 16 | CTX->Sbox1[y >> 8 & 0xFF] << 8 | CTX->Sbox1[y & 0xFF];
-    Ct[0] ^= y ^ Pt[0];
+/* Sbox substitution of the 4 bytes of w */
+#define SPECKR_SBOX32(S, w) \
+    ((uint32_t)S[(w) >> 24 & 0xFF] << 24 | (uint32_t)S[(w) >> 16 & 0xFF] << 16 | (uint32_t)S[(w) >> 8 & 0xFF] << 8 | S[(w) & 0xFF])
 
-    x = CTX->Sbox1[x >> 24 & 0xFF] << 24 | CTX->Sbox1[x >> 16 & 0xFF] << 16 | CTX->Sbox1[x >> 8 & 0xFF] << 8 | CTX->Sbox1[x & 0xFF];
-    Ct[1] ^= x ^ Pt[1];
+/* what a keystream kernel works on: the round keys, the current Sbox1 and the counter */
+typedef struct {
+    const uint32_t *rk;
+    const uint8_t *Sbox1;
+    uint32_t NL, NR;
+    uint8_t loop;
+} speckr_ks;
 
-    // Update Sbox substitution operation follows
-    CTX->it1++; 
-    CTX->it2++;
-    if (CTX->it1 == 2000) {
-        for (i = 0; i < 256; i++) 
-            CTX->Sbox1[i] = CTX->Sbox2[CTX->Sbox1[i]];
-        CTX->it1 = 0;
-        if (CTX->it2 == 2000 * 2000) {
-            for (i = 0; i < 256; i++) 
-                CTX->Sbox2[i] = CTX->Sbox3[CTX->Sbox2[i]];
-            CTX->it2 = 0;
+/*
+ *  One block of the scalar kernel with the constant key window L,
+ *  leaves the kernel once n blocks are done.
+ */
+#define SPECKR_BLOCK(L) \
+    x = x0; \
+    y = speckr_bswap32(NR); \
+    speckr_rounds_##L(&x, &y, rk); \
+    p0 = Pt[2 * b]; /* Pt and Ct may be the same buffer */ \
+    p1 = Pt[2 * b + 1]; \
+    Ct[2 * b] = p0 ^ y ^ (S[x >> 24 & 0xFF] << 24 | S[x >> 16 & 0xFF] << 16 | S[x >> 8 & 0xFF] << 8 | S[x & 0xFF]); \
+    Ct[2 * b + 1] = p1 ^ x ^ (S[y >> 24 & 0xFF] << 24 | S[y >> 16 & 0xFF] << 16 | S[y >> 8 & 0xFF] << 8 | S[y & 0xFF]); \
+    NR++; \
+    if (++b == n) \
+        goto done;
+
+/*
+ *  Scalar keystream kernel: encrypts n blocks with a fixed Sbox1, i.e. n must not
+ *  cross an epoch boundary. Counter and loop are advanced, it1/it2 are left to the caller.
+ *
+ *  loop runs through 0, 7, 14, 3, ... and repeats after 18 blocks, so the body is
+ *  that cycle unrolled and the switch only picks where to enter it.
+ */
+static void speckr_xor_blocks(const uint32_t *Pt, uint32_t *Ct, size_t n, speckr_ks *KS) {
+    const uint32_t *rk = KS->rk;
+    const uint8_t *S = KS->Sbox1;
+    uint32_t NR = KS->NR, x0 = speckr_bswap32(KS->NL);
+    uint32_t x, y, p0, p1;
+    size_t b = 0;
+
+    if (n == 0) 
+        return;
+
+    switch (KS->loop) {
+        for (;;) {
+        case 0:  SPECKR_BLOCK(0)
+        case 7:  SPECKR_BLOCK(7)
+        case 14: SPECKR_BLOCK(14)
+        case 3:  SPECKR_BLOCK(3)
+        case 10: SPECKR_BLOCK(10)
+        case 17: SPECKR_BLOCK(17)
+        case 6:  SPECKR_BLOCK(6)
+        case 13: SPECKR_BLOCK(13)
+        case 2:  SPECKR_BLOCK(2)
+        case 9:  SPECKR_BLOCK(9)
+        case 16: SPECKR_BLOCK(16)
+        case 5:  SPECKR_BLOCK(5)
+        case 12: SPECKR_BLOCK(12)
+        case 1:  SPECKR_BLOCK(1)
+        case 8:  SPECKR_BLOCK(8)
+        case 15: SPECKR_BLOCK(15)
+        case 4:  SPECKR_BLOCK(4)
+        case 11: SPECKR_BLOCK(11)
         }
     }
 
-    CTX->loop = (CTX->loop + SPECKR_ROUNDS) % (25 - SPECKR_ROUNDS);
+done:
+    KS->NR = NR;
+    KS->loop = (KS->loop + SPECKR_ROUNDS * (n % (25 - SPECKR_ROUNDS))) % (25 - SPECKR_ROUNDS);
 }
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SPECKR_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+
+/*
+ *  Counter-parallel kernels: W consecutive counters go through the rounds in
+ *  the W lanes of a vector. Lane j of a batch uses the round keys at offset
+ *  (loop + 7j) % 18 and every batch moves loop by 7W % 18, so there are only
+ *  9 distinct key layouts per kernel call; they are built once in kv.
+ *
+ *  The intrinsics only become straight-line vector code with optimization
+ *  (the Makefile builds the library with -O2). At -O0 every vector goes
+ *  through the stack and AVX2 ran at 31.9 cycles/byte against 8.7 for scalar.
+ *  At -O2, on 256 KiB buffers of an AVX-512 VBMI host, the figures were
+ *  scalar 2.74, avx2 2.10, avx512 1.22, avx512vbmi 0.51.
+ */
+#define SPECKR_PHASES 9
+
+static void speckr_key_phases(uint32_t *kv, int W, const uint32_t *rk, uint8_t loop) {
+    int p, i, j, l;
+
+    for (p = 0; p < SPECKR_PHASES; p++) {
+        l = (loop + p * SPECKR_ROUNDS * W) % (25 - SPECKR_ROUNDS);
+        for (j = 0; j < W; j++) 
+            for (i = 0; i < SPECKR_ROUNDS; i++) 
+                kv[(p * SPECKR_ROUNDS + i) * W + j] = rk[i + (l + SPECKR_ROUNDS * j) % (25 - SPECKR_ROUNDS)];
+    }
+}
+
+/*
+ *  Constant-time Sbox1 lookups: the vector kernels never index memory with
+ *  secret bytes. Sbox1 is loaded into registers once per kernel call, i.e. once
+ *  per epoch, as 16 tables of 16 bytes T[h] = Sbox1[16h .. 16h + 15]. Byte v is
+ *  looked up in every table with pshufb on its low nibble; v ^ 16h saturated
+ *  by + 0x70 keeps bit 7 clear only for h == v >> 4, and pshufb returns 0 for
+ *  indices with bit 7 set, so OR-ing the 16 results leaves Sbox1[v].
+ *  With AVX-512 VBMI two vpermi2b cover 128 entries each and bit 7 picks one.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i speckr_sbox_sse(__m128i v, const __m128i *T) {
+    const __m128i c70 = _mm_set1_epi8(0x70);
+    __m128i r = _mm_setzero_si128();
+    int h;
+
+    for (h = 0; h < 16; h++) 
+        r = _mm_or_si128(r, _mm_shuffle_epi8(T[h], _mm_adds_epu8(_mm_xor_si128(v, _mm_set1_epi8(h << 4)), c70)));
+    return r;
+}
+
+/* 4 lanes */
+__attribute__((target("sse4.1")))
+static void speckr_xor_blocks_sse4(const uint32_t *Pt, uint32_t *Ct, size_t n, speckr_ks *KS) {
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i rotr8 = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i x0 = _mm_set1_epi32(speckr_bswap32(KS->NL));
+    uint32_t kv[SPECKR_PHASES * SPECKR_ROUNDS * 4] __attribute__((aligned(16)));
+    __m128i T[16], x, y, k0, k1;
+    uint32_t NR = KS->NR;
+    size_t b, batches = n / 4;
+    int i, phase = 0;
+
+    speckr_key_phases(kv, 4, KS->rk, KS->loop);
+    for (i = 0; i < 16; i++) 
+        T[i] = _mm_loadu_si128((const __m128i *)(KS->Sbox1 + 16 * i));
+
+    for (b = 0; b < batches; b++) {
+        x = x0;
+        y = _mm_shuffle_epi8(_mm_add_epi32(_mm_set1_epi32(NR), lane), bswap);
+
+        for (i = 0; i < SPECKR_ROUNDS; i++) { // ER32 on 4 lanes
+            x = _mm_shuffle_epi8(x, rotr8);
+            x = _mm_add_epi32(x, y);
+            x = _mm_xor_si128(x, _mm_load_si128((const __m128i *)&kv[(phase * SPECKR_ROUNDS + i) * 4]));
+            y = _mm_or_si128(_mm_slli_epi32(y, 3), _mm_srli_epi32(y, 29));
+            y = _mm_xor_si128(y, x);
+        }
+
+        k0 = _mm_xor_si128(y, speckr_sbox_sse(x, T));
+        k1 = _mm_xor_si128(x, speckr_sbox_sse(y, T));
+
+        x = _mm_xor_si128(_mm_unpacklo_epi32(k0, k1), _mm_loadu_si128((const __m128i *)&Pt[8 * b]));
+        y = _mm_xor_si128(_mm_unpackhi_epi32(k0, k1), _mm_loadu_si128((const __m128i *)&Pt[8 * b + 4]));
+        _mm_storeu_si128((__m128i *)&Ct[8 * b], x);
+        _mm_storeu_si128((__m128i *)&Ct[8 * b + 4], y);
+
+        NR += 4;
+        if (++phase == SPECKR_PHASES) 
+            phase = 0;
+    }
+
+    KS->NR = NR;
+    KS->loop = (KS->loop + SPECKR_ROUNDS * 4 * (batches % (25 - SPECKR_ROUNDS))) % (25 - SPECKR_ROUNDS);
+    speckr_xor_blocks(Pt + 8 * batches, Ct + 8 * batches, n % 4, KS);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i speckr_sbox_avx2(__m256i v, const __m256i *T) {
+    const __m256i c70 = _mm256_set1_epi8(0x70);
+    __m256i r = _mm256_setzero_si256();
+    int h;
+
+    for (h = 0; h < 16; h++) 
+        r = _mm256_or_si256(r, _mm256_shuffle_epi8(T[h], _mm256_adds_epu8(_mm256_xor_si256(v, _mm256_set1_epi8(h << 4)), c70)));
+    return r;
+}
+
+__attribute__((target("avx2")))
+static void speckr_xor_blocks_avx2(const uint32_t *Pt, uint32_t *Ct, size_t n, speckr_ks *KS) {
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i rotr8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                           1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i x0 = _mm256_set1_epi32(speckr_bswap32(KS->NL));
+    uint32_t kv[SPECKR_PHASES * SPECKR_ROUNDS * 8] __attribute__((aligned(32)));
+    __m256i T[16], x, y, k0, k1, lo, hi;
+    uint32_t NR = KS->NR;
+    size_t b, batches = n / 8;
+    int i, phase = 0;
+
+    speckr_key_phases(kv, 8, KS->rk, KS->loop);
+    for (i = 0; i < 16; i++) // the same 16 bytes in both 128-bit lanes, pshufb stays in its lane
+        T[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(KS->Sbox1 + 16 * i)));
+
+    for (b = 0; b < batches; b++) {
+        x = x0;
+        y = _mm256_shuffle_epi8(_mm256_add_epi32(_mm256_set1_epi32(NR), lane), bswap);
+
+        for (i = 0; i < SPECKR_ROUNDS; i++) { // ER32 on 8 lanes
+            x = _mm256_shuffle_epi8(x, rotr8);
+            x = _mm256_add_epi32(x, y);
+            x = _mm256_xor_si256(x, _mm256_load_si256((const __m256i *)&kv[(phase * SPECKR_ROUNDS + i) * 8]));
+            y = _mm256_or_si256(_mm256_slli_epi32(y, 3), _mm256_srli_epi32(y, 29));
+            y = _mm256_xor_si256(y, x);
+        }
+
+        k0 = _mm256_xor_si256(y, speckr_sbox_avx2(x, T));
+        k1 = _mm256_xor_si256(x, speckr_sbox_avx2(y, T));
+
+        /* interleave back to Ct[2b], Ct[2b + 1] order */
+        lo = _mm256_unpacklo_epi32(k0, k1);
+        hi = _mm256_unpackhi_epi32(k0, k1);
+        k0 = _mm256_xor_si256(_mm256_permute2x128_si256(lo, hi, 0x20), _mm256_loadu_si256((const __m256i *)&Pt[16 * b]));
+        k1 = _mm256_xor_si256(_mm256_permute2x128_si256(lo, hi, 0x31), _mm256_loadu_si256((const __m256i *)&Pt[16 * b + 8]));
+        _mm256_storeu_si256((__m256i *)&Ct[16 * b], k0);
+        _mm256_storeu_si256((__m256i *)&Ct[16 * b + 8], k1);
+
+        NR += 8;
+        if (++phase == SPECKR_PHASES) 
+            phase = 0;
+    }
+
+    KS->NR = NR;
+    KS->loop = (KS->loop + SPECKR_ROUNDS * 8 * (batches % (25 - SPECKR_ROUNDS))) % (25 - SPECKR_ROUNDS);
+    speckr_xor_blocks(Pt + 16 * batches, Ct + 16 * batches, n % 8, KS);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i speckr_sbox_avx512(__m512i v, const __m512i *T) {
+    const __m512i c70 = _mm512_set1_epi8(0x70);
+    __m512i r = _mm512_setzero_si512();
+    int h;
+
+    for (h = 0; h < 16; h++) 
+        r = _mm512_or_si512(r, _mm512_shuffle_epi8(T[h], _mm512_adds_epu8(_mm512_xor_si512(v, _mm512_set1_epi8(h << 4)), c70)));
+    return r;
+}
+
+/* T[0..3] is Sbox1, bits 0-6 index T[0]:T[1] or T[2]:T[3], bit 7 picks the pair */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static inline __m512i speckr_sbox_vbmi(__m512i v, const __m512i *T) {
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), 
+            _mm512_permutex2var_epi8(T[0], v, T[1]), _mm512_permutex2var_epi8(T[2], v, T[3]));
+}
+
+/*
+ *  16 lanes, the kernel body is shared by the pshufb and the vpermi2b variant,
+ *  SBOX is the lookup and T holds its tables.
+ */
+#define SPECKR_KERNEL_AVX512(SBOX, T) \
+    const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)); \
+    const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); \
+    const __m512i ilo = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23); \
+    const __m512i ihi = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31); \
+    const __m512i x0 = _mm512_set1_epi32(speckr_bswap32(KS->NL)); \
+    uint32_t kv[SPECKR_PHASES * SPECKR_ROUNDS * 16] __attribute__((aligned(64))); \
+    __m512i x, y, k0, k1; \
+    uint32_t NR = KS->NR; \
+    size_t b, batches = n / 16; \
+    int i, phase = 0; \
+ \
+    speckr_key_phases(kv, 16, KS->rk, KS->loop); \
+ \
+    for (b = 0; b < batches; b++) { \
+        x = x0; \
+        y = _mm512_shuffle_epi8(_mm512_add_epi32(_mm512_set1_epi32(NR), lane), bswap); \
+ \
+        for (i = 0; i < SPECKR_ROUNDS; i++) { /* ER32 on 16 lanes */ \
+            x = _mm512_ror_epi32(x, 8); \
+            x = _mm512_add_epi32(x, y); \
+            x = _mm512_xor_si512(x, _mm512_load_si512(&kv[(phase * SPECKR_ROUNDS + i) * 16])); \
+            y = _mm512_rol_epi32(y, 3); \
+            y = _mm512_xor_si512(y, x); \
+        } \
+ \
+        k0 = _mm512_xor_si512(y, SBOX(x, T)); \
+        k1 = _mm512_xor_si512(x, SBOX(y, T)); \
+ \
+        x = _mm512_xor_si512(_mm512_permutex2var_epi32(k0, ilo, k1), _mm512_loadu_si512(&Pt[32 * b])); \
+        y = _mm512_xor_si512(_mm512_permutex2var_epi32(k0, ihi, k1), _mm512_loadu_si512(&Pt[32 * b + 16])); \
+        _mm512_storeu_si512(&Ct[32 * b], x); \
+        _mm512_storeu_si512(&Ct[32 * b + 16], y); \
+ \
+        NR += 16; \
+        if (++phase == SPECKR_PHASES) \
+            phase = 0; \
+    } \
+ \
+    KS->NR = NR; \
+    KS->loop = (KS->loop + SPECKR_ROUNDS * 16 * (batches % (25 - SPECKR_ROUNDS))) % (25 - SPECKR_ROUNDS); \
+    speckr_xor_blocks(Pt + 32 * batches, Ct + 32 * batches, n % 16, KS);
+
+__attribute__((target("avx512f,avx512bw")))
+static void speckr_xor_blocks_avx512(const uint32_t *Pt, uint32_t *Ct, size_t n, speckr_ks *KS) {
+    __m512i T[16];
+    int h;
+
+    for (h = 0; h < 16; h++) 
+        T[h] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(KS->Sbox1 + 16 * h)));
+    SPECKR_KERNEL_AVX512(speckr_sbox_avx512, T)
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void speckr_xor_blocks_vbmi(const uint32_t *Pt, uint32_t *Ct, size_t n, speckr_ks *KS) {
+    __m512i T[4];
+    int h;
+
+    for (h = 0; h < 4; h++) 
+        T[h] = _mm512_loadu_si512(KS->Sbox1 + 64 * h);
+    SPECKR_KERNEL_AVX512(speckr_sbox_vbmi, T)
+}
+#endif /* SPECKR_X86 */
+
+typedef void (*speckr_kernel_fn)(const uint32_t *Pt, uint32_t *Ct, size_t n, speckr_ks *KS);
+
+enum { SPECKR_CPU_SSE4 = 1, SPECKR_CPU_AVX2 = 2, SPECKR_CPU_AVX512 = 4, SPECKR_CPU_VBMI = 8 };
+
+/*
+ *  Kernels for the bulk path, narrowest first. speckr_dispatch_init() binds the
+ *  widest one the CPU and OS support that is faster than scalar, unless
+ *  SPECKR_KERNEL=<name> in the environment or speckr_set_kernel() asks for
+ *  another. The 4-lane sse4 kernel is only reachable that way: its 16 pshufb
+ *  per Sbox lookup make it slower than scalar (4.2 against 2.7 cycles/byte).
+ */
+static const struct {
+    const char *name;
+    int cpu;
+    int pick;                         // candidate for speckr_dispatch_init()
+    speckr_kernel_fn xor_blocks;
+} speckr_kernels[] = {
+    { "scalar", 0, 1, speckr_xor_blocks },
+#ifdef SPECKR_X86
+    { "sse4", SPECKR_CPU_SSE4, 0, speckr_xor_blocks_sse4 },
+    { "avx2", SPECKR_CPU_AVX2, 1, speckr_xor_blocks_avx2 },
+    { "avx512", SPECKR_CPU_AVX512, 1, speckr_xor_blocks_avx512 },
+    { "avx512vbmi", SPECKR_CPU_AVX512 | SPECKR_CPU_VBMI, 1, speckr_xor_blocks_vbmi },
+#endif
+};
+
+#define SPECKR_NKERNELS (sizeof(speckr_kernels) / sizeof(speckr_kernels[0]))
+_Static_assert(SPECKR_NKERNELS <= SPECKR_STATS_KERNELS, "speckr_stats.kernel_bytes is too small");
+
+static int speckr_kernel_id = -1; // index into speckr_kernels, -1 until bound
+
+static int speckr_cpu_features(void) {
+    int f = 0;
+#ifdef SPECKR_X86
+    unsigned int a, b, c, d, xcr0 = 0;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) 
+        return 0;
+    if (c & bit_SSE4_1) 
+        f |= SPECKR_CPU_SSE4;
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) 
+        return f;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (d) : "c" (0)); // which register states the OS saves
+    if ((xcr0 & 0x06) != 0x06 || !__get_cpuid_count(7, 0, &a, &b, &c, &d)) 
+        return f;
+    if (b & bit_AVX2) 
+        f |= SPECKR_CPU_AVX2;
+    if ((b & bit_AVX512F) && (b & bit_AVX512BW) && (xcr0 & 0xE0) == 0xE0) 
+        f |= SPECKR_CPU_AVX512;
+    if ((f & SPECKR_CPU_AVX512) && (c & bit_AVX512VBMI)) 
+        f |= SPECKR_CPU_VBMI;
+#endif
+    return f;
+}
+
+/* the kernel called name, or with name == NULL the best one to pick */
+static int speckr_find_kernel(const char *name, int cpu) {
+    int i;
+
+    for (i = SPECKR_NKERNELS - 1; i >= 0; i--) 
+        if ((speckr_kernels[i].cpu & cpu) == speckr_kernels[i].cpu && 
+                (name == NULL ? speckr_kernels[i].pick : strcmp(name, speckr_kernels[i].name) == 0)) 
+            return i;
+    return -1;
+}
+
+void speckr_dispatch_init(void) {
+    int cpu, id = -1;
+    const char *env;
+
+    if (__atomic_load_n(&speckr_kernel_id, __ATOMIC_ACQUIRE) >= 0) 
+        return;
+    cpu = speckr_cpu_features();
+    if ((env = getenv("SPECKR_KERNEL")) != NULL) 
+        id = speckr_find_kernel(env, cpu);
+    if (id < 0) 
+        id = speckr_find_kernel(NULL, cpu);
+    __atomic_store_n(&speckr_kernel_id, id, __ATOMIC_RELEASE);
+}
+
+int speckr_set_kernel(const char *name) {
+    int id = speckr_find_kernel(name, speckr_cpu_features());
+
+    if (id < 0) 
+        return -1;
+    __atomic_store_n(&speckr_kernel_id, id, __ATOMIC_RELEASE);
+    return 0;
+}
+
+const char *speckr_kernel_name(void) {
+    speckr_dispatch_init();
+    return speckr_kernels[speckr_kernel_id].name;
+}
+
+/*
+ *  Encrypts nblocks consecutive 64-bit blocks (2 * nblocks words) from Pt into Ct,
+ *  bit-identical to nblocks calls of SpeckREncrypt(). Pt and Ct may overlap exactly.
+ */
+void SpeckREncrypt_blocks(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX) {
+    speckr_kernel_fn kernel;
+    speckr_ks KS = { CTX->derived_key_r, CTX->Sbox1, CTX->NL, CTX->NR, CTX->loop };
+    uint64_t first = CTX->blkno;
+    size_t n;
+
+    speckr_dispatch_init();
+    kernel = speckr_kernels[speckr_kernel_id].xor_blocks;
+    CTX->ks_avail = 0;
+    SPECKR_COUNT(blocks, nblocks);
+    SPECKR_COUNT(kernel_bytes[speckr_kernel_id], 8 * (uint64_t)nblocks);
+    SPECKR_PROBE2(blocks_start, nblocks, CTX->blkno);
+
+    while (nblocks > 0) {
+        n = SPECKR_EPOCH - CTX->it1; // blocks left until the next Sbox update
+        if (n > nblocks) 
+            n = nblocks;
+
+        kernel(Pt, Ct, n, &KS);
+        CTX->NR = KS.NR;
+        CTX->loop = KS.loop;
+
+        CTX->it1 += n;
+        CTX->it2 += n;
+        CTX->blkno += n;
+        speckr__sbox_update(CTX);
+
+        Pt += 2 * n;
+        Ct += 2 * n;
+        nblocks -= n;
+    }
+    SPECKR_PROBE2(blocks_done, CTX->blkno - first, CTX->blkno);
+}
+
+/* one piece at a time so the hasher reads what the kernel just touched */
+void speckr_encrypt_hash(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX, blake3_hasher *h, int what) {
+    size_t n;
+
+    while (nblocks > 0) {
+        n = nblocks < SPECKR_HASH_PIECE / 8 ? nblocks : SPECKR_HASH_PIECE / 8;
+        if (what == SPECKR_HASH_IN)
+            blake3_hasher_update(h, Pt, 8 * n);
+        SpeckREncrypt_blocks(Pt, Ct, n, CTX);
+        if (what == SPECKR_HASH_OUT)
+            blake3_hasher_update(h, Ct, 8 * n);
+        Pt += 2 * n;
+        Ct += 2 * n;
+        nblocks -= n;
+    }
+}
+
+/*
+ *  Bytes [offset, offset + len) of the stream: seek to the first block, then a
+ *  padded copy for a partial head and tail block, the middle goes straight
+ *  through the kernels when in and out are word aligned and through a small
+ *  bounce buffer otherwise.
+ */
+void speckr_crypt_range(speckr_ctx *CTX, uint64_t offset, const uint8_t *in, uint8_t *out, size_t len) {
+    uint32_t buf[2 * 512];
+    size_t head = offset % 8, n;
+
+    speckr_seek(CTX, offset / 8);
+
+    if (head != 0 && len > 0) {
+        n = 8 - head < len ? 8 - head : len;
+        memset(buf, 0, 8);
+        memcpy((uint8_t *)buf + head, in, n);
+        SpeckREncrypt_blocks(buf, buf, 1, CTX);
+        memcpy(out, (uint8_t *)buf + head, n);
+        in += n; out += n; len -= n;
+    }
+
+    if (((uintptr_t)in | (uintptr_t)out) % sizeof(uint32_t) == 0) {
+        n = len / 8;
+        SpeckREncrypt_blocks((const uint32_t *)in, (uint32_t *)out, n, CTX);
+        in += 8 * n; out += 8 * n; len -= 8 * n;
+    }
+    while (len > 0) {
+        n = len < sizeof(buf) ? len : sizeof(buf);
+        if (n % 8) 
+            memset((uint8_t *)buf + n / 8 * 8, 0, 8); // a partial tail block is zero padded
+        memcpy(buf, in, n);
+        SpeckREncrypt_blocks(buf, buf, (n + 7) / 8, CTX);
+        memcpy(out, buf, n);
+        in += n; out += n; len -= n;
+    }
+}
+
+/*
+ *  Byte stream: leftover keystream first, then whole blocks, then one more block
+ *  whose unused keystream bytes stay in ks[8 - ks_avail..7]. Whole blocks go
+ *  through the block function directly when both buffers are word aligned and
+ *  are copied through an aligned bounce buffer otherwise; bytes are host-order
+ *  words either way. The block functions clear ks_avail, so the callers keep it
+ *  in a local until the end.
+ */
+typedef int (*speckr_blocks_fn)(void *state, const uint32_t *Pt, uint32_t *Ct, size_t nblocks);
+
+static int speckr_ctx_blocks(void *state, const uint32_t *Pt, uint32_t *Ct, size_t nblocks) {
+    SpeckREncrypt_blocks(Pt, Ct, nblocks, state);
+    return 0;
+}
+
+static int speckr_cursor_blocks(void *state, const uint32_t *Pt, uint32_t *Ct, size_t nblocks) {
+    return speckr_cursor_encrypt(state, Pt, Ct, nblocks);
+}
+
+static int speckr_stream(speckr_blocks_fn fn, void *state, uint8_t *ks, uint8_t *ks_avail, 
+        const uint8_t *in, uint8_t *out, size_t len) {
+    uint32_t buf[2 * 512];
+    size_t i, n;
+
+    for (; *ks_avail > 0 && len > 0; (*ks_avail)--, len--) 
+        *out++ = *in++ ^ ks[8 - *ks_avail];
+
+    if (((uintptr_t)in | (uintptr_t)out) % sizeof(uint32_t) == 0 && len >= 8) {
+        n = len / 8;
+        if (fn(state, (const uint32_t *)in, (uint32_t *)out, n) == -1) 
+            return -1;
+        in += 8 * n; out += 8 * n; len -= 8 * n;
+    }
+    while (len >= 8) {
+        n = len / 8 < 512 ? len / 8 : 512;
+        memcpy(buf, in, 8 * n);
+        if (fn(state, buf, buf, n) == -1) 
+            return -1;
+        memcpy(out, buf, 8 * n);
+        in += 8 * n; out += 8 * n; len -= 8 * n;
+    }
+
+    if (len > 0) { // the keystream is the encryption of a zero block
+        buf[0] = buf[1] = 0;
+        if (fn(state, buf, buf, 1) == -1) 
+            return -1;
+        memcpy(ks, buf, 8);
+        for (i = 0; i < len; i++) 
+            out[i] = in[i] ^ ks[i];
+        *ks_avail = 8 - len;
+    }
+    return 0;
+}
+
+void speckr_stream_xor(speckr_ctx *CTX, const uint8_t *in, uint8_t *out, size_t len) {
+    uint8_t left = CTX->ks_avail;
+
+    speckr_stream(speckr_ctx_blocks, CTX, CTX->ks, &left, in, out, len);
+    CTX->ks_avail = left;
+}
+
+int speckr_cursor_stream_xor(speckr_cursor *cur, const uint8_t *in, uint8_t *out, size_t len) {
+    uint8_t left = cur->ks_avail;
+    int ret;
+
+    ret = speckr_stream(speckr_cursor_blocks, cur, cur->ks, &left, in, out, len);
+    cur->ks_avail = left;
+    return ret;
+}
+
+/*
+ *  Keystream of one packet as SpeckREncrypt_async() produces it right after
+ *  speckr_reset_ctr(): block b uses the counter packet_no * packet_size + 8 * (8 * b),
+ *  it1, it2 and loop start from 0 and the Sboxes from those of speckr_init().
+ *  Sbox1/Sbox2 are only copied to the stack once the packet crosses an epoch,
+ *  nothing in KEY is written. With be set the bytes are big-endian words
+ *  instead of the host's.
+ */
+static void speckr_packet_xor(const speckr_ctx *KEY, uint64_t packet_no, uint64_t packet_size, 
+        const uint8_t *in, uint8_t *out, size_t len, int be) {
+    const uint8_t *S1 = KEY->Sbox1_0, *S2 = KEY->Sbox2_0;
+    uint8_t T1[256], T2[256];
+    uint64_t datasize = packet_no * packet_size;
+    uint32_t NL, NR, x, y, w[2], it1 = 0, it2 = 0;
+    uint8_t loop = 0;
+    size_t b, rest;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    int swap = be;
+#else
+    int swap = 0; // big-endian words are the host's
+    (void)be;
+#endif
+
+    for (b = 0; 8 * b < len; b++, datasize += 8 * 8) {
+        split_uint64_to_uint32(datasize, &NR, &NL);
+        x = speckr_bswap32(NL);
+        y = speckr_bswap32(NR);
+        speckr_rounds[loop](&x, &y, KEY->derived_key_r);
+
+        rest = len - 8 * b < 8 ? len - 8 * b : 8;
+        w[0] = w[1] = 0;
+        memcpy(w, in + 8 * b, rest); // any alignment, in and out may be the same
+        if (swap) {
+            w[0] = speckr_bswap32(w[0]);
+            w[1] = speckr_bswap32(w[1]);
+        }
+        w[0] ^= y ^ SPECKR_SBOX32(S1, x);
+        w[1] ^= x ^ SPECKR_SBOX32(S1, y);
+        if (swap) {
+            w[0] = speckr_bswap32(w[0]);
+            w[1] = speckr_bswap32(w[1]);
+        }
+        memcpy(out + 8 * b, w, rest);
+
+        it1++;
+        it2++;
+        if (it1 == SPECKR_EPOCH) {
+            speckr_sbox_compose(T1, S2, S1);
+            S1 = T1;
+            it1 = 0;
+            SPECKR_COUNT(sbox1_updates, 1);
+            if (it2 == SPECKR_EPOCH * SPECKR_EPOCH) {
+                speckr_sbox_compose(T2, KEY->Sbox3, S2);
+                S2 = T2;
+                it2 = 0;
+                SPECKR_COUNT(sbox2_updates, 1);
+            }
+        }
+        loop += SPECKR_ROUNDS;
+        if (loop >= 25 - SPECKR_ROUNDS) 
+            loop -= 25 - SPECKR_ROUNDS;
+    }
+    SPECKR_COUNT(blocks, b);
+}
+
+void speckr_packet_encrypt(const speckr_ctx *KEY, uint64_t packet_no, uint64_t packet_size, 
+        const void *in, void *out, size_t len) {
+    speckr_packet_xor(KEY, packet_no, packet_size, in, out, len, 0);
+}
+
+void speckr_packet_encrypt_batch(const speckr_ctx *KEY, uint64_t packet_size, const speckr_pktvec *v, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) 
+        speckr_packet_xor(KEY, v[i].packet_no, packet_size, v[i].in, v[i].out, v[i].len, 0);
+}
+
+/* message msg_no is packet msg_no of 2^32 bytes, so its blocks use NL = msg_no */
+int speckr_msg_seal(const speckr_ctx *KEY, uint64_t msg_no, void *buf, size_t len) {
+    if (msg_no > UINT32_MAX || len > SPECKR_MSG_MAXLEN) 
+        return -1;
+    speckr_packet_xor(KEY, msg_no, (uint64_t)1 << 32, buf, buf, len, 1);
+    return 0;
+}
+
+int speckr_msg_open(const speckr_ctx *KEY, uint64_t msg_no, void *buf, size_t len) {
+    return speckr_msg_seal(KEY, msg_no, buf, len);
+}
+
+/*
+ *  Shared keys and per-stream cursors
+ */
+
+speckr_key *speckr_key_new(const speckr_ctx *CTX) {
+    speckr_key *key = aligned_alloc(64, (sizeof(speckr_key) + 63) & ~(size_t)63);
+
+    if (key == NULL) 
+        return NULL;
+    key->refcnt = 1;
+    memcpy(key->derived_key_r, CTX->derived_key_r, sizeof(key->derived_key_r));
+    memcpy(key->Sbox1, CTX->Sbox1_0, 256);
+    memcpy(key->Sbox2, CTX->Sbox2_0, 256);
+    memcpy(key->Sbox3, CTX->Sbox3, 256);
+    key->kdf = CTX->kdf;
+    key->t_cost = CTX->t_cost;
+    key->m_cost = CTX->m_cost;
+    key->parallelism = CTX->parallelism;
+    return key;
+}
+
+speckr_key *speckr_key_ref(speckr_key *key) {
+    __atomic_add_fetch(&key->refcnt, 1, __ATOMIC_RELAXED);
+    return key;
+}
+
+void speckr_key_unref(speckr_key *key) {
+    if (key == NULL || __atomic_sub_fetch(&key->refcnt, 1, __ATOMIC_ACQ_REL) != 0) 
+        return;
+    speckr_wipe(key, 0, sizeof(*key));
+    free(key);
+}
+
+static void speckr_cursor_init(speckr_cursor *cur, const speckr_key *key, uint8_t *sbox_storage) {
+    cur->key = key;
+    cur->sbox = sbox_storage;
+    cur->own = 0;
+    cur->evolved = 0;
+    cur->blkno = 0;
+    cur->NL = cur->NR = 0;
+    cur->it1 = cur->it2 = 0;
+    cur->loop = 0;
+    cur->ks_avail = 0;
+}
+
+void speckr_cursor_open(speckr_cursor *cur, speckr_key *key, uint8_t *sbox_storage) {
+    speckr_cursor_init(cur, speckr_key_ref(key), sbox_storage);
+}
+
+void speckr_cursor_close(speckr_cursor *cur) {
+    if (cur->own) 
+        free(cur->sbox);
+    speckr_key_unref((speckr_key *)cur->key);
+    cur->key = NULL;
+    cur->sbox = NULL;
+    cur->own = 0;
+}
+
+/* the cursor's own Sbox1|Sbox2, copied from the key the first time they evolve */
+static int speckr_cursor_materialize(speckr_cursor *cur) {
+    if (cur->evolved) 
+        return 0;
+    if (cur->sbox == NULL) {
+        if ((cur->sbox = malloc(2 * 256)) == NULL) 
+            return -1;
+        cur->own = 1;
+    }
+    memcpy(cur->sbox, cur->key->Sbox1, 256);
+    memcpy(cur->sbox + 256, cur->key->Sbox2, 256);
+    cur->evolved = 1;
+    return 0;
+}
+
+int speckr_cursor_seek(speckr_cursor *cur, uint64_t block_index) {
+    uint64_t from = cur->blkno;
+
+    if (block_index < from || block_index < SPECKR_EPOCH) {
+        cur->evolved = 0; // back to the key's tables
+        from = 0;
+    }
+    if (block_index >= SPECKR_EPOCH) {
+        if (speckr_cursor_materialize(cur) == -1) 
+            return -1;
+        speckr_sbox_advance(cur->sbox, cur->sbox + 256, cur->key->Sbox3, from, block_index);
+    }
+
+    cur->NL = 0;
+    cur->NR = (uint32_t)block_index;
+    cur->it1 = block_index % SPECKR_EPOCH;
+    cur->it2 = block_index % (SPECKR_EPOCH * SPECKR_EPOCH);
+    cur->loop = (SPECKR_ROUNDS * (block_index % (25 - SPECKR_ROUNDS))) % (25 - SPECKR_ROUNDS);
+    cur->blkno = block_index;
+    cur->ks_avail = 0;
+    return 0;
+}
+
+int speckr_cursor_encrypt(speckr_cursor *cur, const uint32_t *Pt, uint32_t *Ct, size_t nblocks) {
+    speckr_kernel_fn kernel;
+    speckr_ks KS = { cur->key->derived_key_r, NULL, cur->NL, cur->NR, cur->loop };
+    size_t n;
+
+    speckr_dispatch_init();
+    kernel = speckr_kernels[speckr_kernel_id].xor_blocks;
+    cur->ks_avail = 0;
+
+    while (nblocks > 0) {
+        n = SPECKR_EPOCH - cur->it1;
+        if (n > nblocks) 
+            n = nblocks;
+        if (n == SPECKR_EPOCH - cur->it1 && speckr_cursor_materialize(cur) == -1) 
+            return -1; // this run ends in an Sbox update, nothing is encrypted yet
+
+        KS.Sbox1 = cur->evolved ? cur->sbox : cur->key->Sbox1;
+        kernel(Pt, Ct, n, &KS);
+        SPECKR_COUNT(blocks, n);
+        SPECKR_COUNT(kernel_bytes[speckr_kernel_id], 8 * (uint64_t)n);
+        cur->NR = KS.NR;
+        cur->loop = KS.loop;
+
+        cur->it1 += n;
+        cur->it2 += n;
+        cur->blkno += n;
+        if (cur->it1 == SPECKR_EPOCH) {
+            speckr_sbox_compose(cur->sbox, cur->sbox + 256, cur->sbox);
+            cur->it1 = 0;
+            SPECKR_COUNT(sbox1_updates, 1);
+            SPECKR_PROBE1(sbox1_update, cur->blkno);
+            if (cur->it2 == SPECKR_EPOCH * SPECKR_EPOCH) {
+                speckr_sbox_compose(cur->sbox + 256, cur->key->Sbox3, cur->sbox + 256);
+                cur->it2 = 0;
+                SPECKR_COUNT(sbox2_updates, 1);
+                SPECKR_PROBE1(sbox2_update, cur->blkno);
+            }
+        }
+
+        Pt += 2 * n;
+        Ct += 2 * n;
+        nblocks -= n;
+    }
+    return 0;
+}
+
+/*
+ *  Session table
+ *
+ *  One mapping holds capacity cursors, then their 512-byte Sbox slots, then the
+ *  free list links. Free ids form a stack whose head is packed with a tag,
+ *  tag << 32 | id, and moved with a CAS; the tag changes on every push so a
+ *  stale head cannot be swapped back in (ABA). The mapping is not touched here
+ *  unless SPECKR_ARENA_PREFAULT is given, so the page holding a cursor is
+ *  faulted in by the first thread that acquires it and lands on its NUMA node.
+ */
+struct speckr_sessions {
+    uint64_t head;                 // tag << 32 | first free id
+    char pad[64 - sizeof(uint64_t)];
+    speckr_key *key;
+    uint32_t capacity;
+    speckr_cursor *cur;
+    uint8_t *sbox;
+    uint32_t *next;
+    uint8_t *mem;
+    size_t size;
+};
+
+#define SPECKR_FREE_END UINT32_MAX
+
+speckr_sessions *speckr_sessions_new(speckr_key *key, uint32_t capacity, int flags) {
+    speckr_sessions *t;
+    size_t size = (size_t)capacity * (sizeof(speckr_cursor) + 2 * 256 + sizeof(uint32_t));
+    uint32_t i;
+
+    if (capacity == 0 || capacity == SPECKR_FREE_END) 
+        return NULL;
+    if ((t = aligned_alloc(64, sizeof(*t))) == NULL) 
+        return NULL;
+    if (flags & SPECKR_ARENA_HUGE) 
+        size = (size + (2 << 20) - 1) & ~(size_t)((2 << 20) - 1);
+    if ((t->mem = speckr_arena_map(size, flags)) == NULL) {
+        free(t);
+        return NULL;
+    }
+    t->size = size;
+    t->capacity = capacity;
+    t->cur = (speckr_cursor *)t->mem;
+    t->sbox = t->mem + (size_t)capacity * sizeof(speckr_cursor);
+    t->next = (uint32_t *)(t->sbox + (size_t)capacity * 2 * 256);
+    for (i = 0; i < capacity; i++) 
+        t->next[i] = i + 1 < capacity ? i + 1 : SPECKR_FREE_END;
+    t->head = 0;
+    t->key = speckr_key_ref(key); // one reference for all sessions
+    return t;
+}
+
+void speckr_sessions_free(speckr_sessions *t) {
+    if (t == NULL) 
+        return;
+    speckr_wipe(t->mem, 0, t->size);
+    munmap(t->mem, t->size);
+    speckr_key_unref(t->key);
+    free(t);
+}
+
+uint32_t speckr_session_acquire(speckr_sessions *t) {
+    uint64_t h = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE), nh;
+    uint32_t id;
+
+    do {
+        id = (uint32_t)h;
+        if (id == SPECKR_FREE_END) 
+            return SPECKR_SESSION_NONE;
+        nh = (h & ~(uint64_t)UINT32_MAX) | __atomic_load_n(&t->next[id], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&t->head, &h, nh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    speckr_cursor_init(&t->cur[id], t->key, t->sbox + (size_t)id * 2 * 256);
+    return id;
+}
+
+speckr_cursor *speckr_session_get(speckr_sessions *t, uint32_t id) {
+    return &t->cur[id];
+}
+
+void speckr_session_release(speckr_sessions *t, uint32_t id) {
+    uint64_t h = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE), nh;
+
+    if (t->cur[id].evolved) 
+        speckr_wipe(t->sbox + (size_t)id * 2 * 256, 0, 2 * 256);
+    t->cur[id].evolved = 0;
+    do {
+        __atomic_store_n(&t->next[id], (uint32_t)h, __ATOMIC_RELAXED);
+        nh = ((h >> 32) + 1) << 32 | id;
+    } while (!__atomic_compare_exchange_n(&t->head, &h, nh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
@@ -1,4 +1,13 @@
+#ifndef SPECKR_H
+#define SPECKR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct blake3_hasher; /* blake3.h, only needed by the callers of speckr_encrypt_hash() */
+
 #define SPECKR_ROUNDS 7 
+#define SPECKR_EPOCH 2000 /* blocks between Sbox1 updates */
 
 /*
  * SpeckR context
@@ -7,8 +16,13 @@ typedef struct {
 	uint32_t it1, it2;
 	uint32_t NL, NR;
 	uint8_t Sbox1[256], Sbox2[256], Sbox3[256];
+	uint8_t Sbox1_0[256], Sbox2_0[256]; // Sbox1 and Sbox2 as derived by speckr_init()
 	uint8_t loop;
+	uint64_t blkno;       // blocks encrypted since init/reset
+	uint8_t ks[8];        // keystream of the last block speckr_stream_xor() used
+	uint8_t ks_avail;     // bytes of it not yet used, the last ks_avail of ks
 	uint32_t derived_key_r[26];
+	uint32_t kdf;         // SPECKR_KDF_V1 or SPECKR_KDF_V2
 	uint32_t t_cost;      // 2-pass computation
 	uint32_t m_cost;      // 64 mebibytes memory usage
 	uint32_t parallelism; // number of threads and lanes
@@ -26,6 +40,62 @@ typedef struct {
 void SpeckRKeySchedule(uint32_t K[],uint32_t rk[]);
 void SpeckREncrypt(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX);
 
+/*
+ *  Not API: the Sbox1 (and Sbox2) update due when it1 reaches SPECKR_EPOCH,
+ *  exported only for speckr_inline.h. Calling it at any other point corrupts
+ *  the Sbox schedule of CTX.
+ */
+void speckr__sbox_update(speckr_ctx *CTX);
+
+/*
+ *  Bulk version of SpeckREncrypt(): Pt and Ct hold 2 * nblocks words and the
+ *  output is identical to calling SpeckREncrypt() once per block. In place is fine.
+ */
+void SpeckREncrypt_blocks(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX);
+
+/*
+ *  SpeckREncrypt_blocks() runs on a kernel ("scalar", "sse4", "avx2", "avx512",
+ *  "avx512vbmi") picked with cpuid the first time speckr_init() or the bulk path runs.
+ *  The vector kernels keep Sbox1 in registers and look it up with pshufb or
+ *  vpermi2b, so they have no secret-dependent memory accesses; the scalar
+ *  kernel and SpeckREncrypt() still index the Sbox1 table. "sse4" is slower than
+ *  scalar and never picked by cpuid; name it to get the constant-time lookups
+ *  on CPUs without AVX2. The SPECKR_KERNEL environment variable or speckr_set_kernel() force another
+ *  one for benchmarking; speckr_set_kernel(NULL) selects the best again.
+ *  speckr_set_kernel() returns -1 if the name is unknown or the CPU lacks it.
+ */
+void speckr_dispatch_init(void);
+int speckr_set_kernel(const char *name);
+const char *speckr_kernel_name(void);
+
+/*
+ *  Opt-in counters, nothing is counted until speckr_stats_enable(1). Each thread
+ *  counts into its own copy: speckr_stats_get() and speckr_stats_reset() see the
+ *  calling thread's, and the workers of speckr_encrypt_parallel() and the ring
+ *  producer add theirs to the thread that started them when they finish.
+ *  speckr_stats_add() does the same for threads of the application.
+ *
+ *  kdf_ns[i] is the wall time of Argon2 pass i of speckr_init_ex() (V1 runs
+ *  three, V2 one). kernel_bytes[] is indexed in speckr_set_kernel() name order,
+ *  "scalar" first; SpeckREncrypt() and the packet API are counted in blocks only.
+ */
+#define SPECKR_STATS_KERNELS 5
+#define SPECKR_STATS_PASSES 3
+
+typedef struct {
+	uint64_t blocks;                             // 8-byte blocks of keystream used, every entry point
+	uint64_t sbox1_updates;                      // Sbox1 epoch updates
+	uint64_t sbox2_updates;                      // Sbox2 updates, every SPECKR_EPOCH^2 blocks
+	uint64_t kdf_calls;                          // speckr_init_ex() calls
+	uint64_t kdf_ns[SPECKR_STATS_PASSES];        // summed over the calls
+	uint64_t kernel_bytes[SPECKR_STATS_KERNELS];
+} speckr_stats;
+
+void speckr_stats_enable(int on);
+void speckr_stats_get(speckr_stats *st);
+void speckr_stats_reset(void);
+void speckr_stats_add(const speckr_stats *st);
+
 /*
  *  The _async() function is for encrypting out of order packets like UDP 
  *  We recommend fixed size for the packet_size to avoid repeating the counter
@@ -41,8 +111,253 @@ void SpeckREncrypt(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX);
 void SpeckREncrypt_async(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX, 
 		uint64_t packet_no, uint64_t packet_size, uint64_t offset);
 
+/*
+ *  Stateless packet API: encrypts a whole packet of len bytes with a read-only
+ *  KEY, the same as speckr_ctx_dup() + speckr_reset_ctr() followed by
+ *  SpeckREncrypt_async() with offset 0, 8, 16, ... on each 64-bit block.
+ *  The bytes are the in-memory words SpeckREncrypt() takes, a trailing partial
+ *  block is treated as zero padded. in == out is allowed, alignment is not needed.
+ *  Only the key, Sbox3 and the initial Sbox1/Sbox2 of KEY are read, so any number
+ *  of threads can share one context without locking.
+ */
+typedef struct {
+	uint64_t packet_no;
+	const void *in;
+	void *out;
+	size_t len;
+} speckr_pktvec;
+
+void speckr_packet_encrypt(const speckr_ctx *KEY, uint64_t packet_no, uint64_t packet_size, 
+		const void *in, void *out, size_t len);
+void speckr_packet_encrypt_batch(const speckr_ctx *KEY, uint64_t packet_size, const speckr_pktvec *v, size_t count);
+
+/*
+ *  Message API for text lines and datagrams: encrypts (seal) or decrypts (open)
+ *  len bytes of message msg_no in place, any alignment, with the async counter
+ *  derivation of the packet API, message msg_no being packet msg_no of 2^32
+ *  bytes. Each 4 bytes are one big-endian word, as textline's string_to_blocks()
+ *  packs them; a partial last word or block is zero padded at the end.
+ *  Messages are independent of each other and KEY is only read.
+ *
+ *  Returns -1 without touching buf if msg_no >= 2^32 or len > SPECKR_MSG_MAXLEN,
+ *  where blocks would run into the counters of the next message.
+ */
+#define SPECKR_MSG_MAXLEN ((size_t)1 << 29)
+
+int speckr_msg_seal(const speckr_ctx *KEY, uint64_t msg_no, void *buf, size_t len);
+int speckr_msg_open(const speckr_ctx *KEY, uint64_t msg_no, void *buf, size_t len);
+
+/*
+ *  Shared keys and per-stream cursors
+ *
+ *  A speckr_key is the immutable, refcounted part of a context: round keys and
+ *  the Sboxes as speckr_init() derived them (~870 bytes). A speckr_cursor is one
+ *  stream position over a key and fits a cache line; it only needs its own 512
+ *  bytes of Sbox1|Sbox2 once the stream passes the first 2000 blocks. Pass that
+ *  storage to speckr_cursor_open() or NULL to have it malloc()ed on demand.
+ *  A cursor produces the same keystream as a speckr_ctx at the same position.
+ *
+ *  speckr_cursor_seek() and speckr_cursor_encrypt() return -1 only if the
+ *  on-demand Sbox storage cannot be allocated.
+ */
+typedef struct {
+	uint32_t refcnt;
+	uint32_t derived_key_r[26];
+	uint8_t Sbox1[256], Sbox2[256], Sbox3[256];
+	uint32_t kdf, t_cost, m_cost, parallelism;
+} speckr_key;
+
+typedef struct {
+	const speckr_key *key;
+	uint8_t *sbox;        // evolved Sbox1 | Sbox2, valid when evolved
+	uint64_t blkno;
+	uint32_t NL, NR;
+	uint32_t it1, it2;
+	uint8_t loop;
+	uint8_t evolved;      // 0: Sbox1/Sbox2 are still the key's
+	uint8_t own;          // sbox was malloc()ed by the cursor
+	uint8_t ks_avail;     // as in speckr_ctx
+	uint8_t ks[8];
+} __attribute__((aligned(64))) speckr_cursor;
+
+speckr_key *speckr_key_new(const speckr_ctx *CTX); /* from a context after speckr_init() */
+speckr_key *speckr_key_ref(speckr_key *key);
+void speckr_key_unref(speckr_key *key);
+
+void speckr_cursor_open(speckr_cursor *cur, speckr_key *key, uint8_t *sbox_storage);
+void speckr_cursor_close(speckr_cursor *cur);
+int speckr_cursor_seek(speckr_cursor *cur, uint64_t block_index);
+int speckr_cursor_encrypt(speckr_cursor *cur, const uint32_t *Pt, uint32_t *Ct, size_t nblocks);
+
+/*
+ *  Session table: a fixed pool of cursors over one key, indexed by session id.
+ *  Acquire and release are O(1), lock-free and never allocate; an acquired
+ *  session starts at block 0 like a speckr_ctx_dup() + speckr_reset_ctr() copy
+ *  of the context the key came from, and its Sbox storage is preallocated.
+ *  flags takes SPECKR_ARENA_HUGE (huge pages, else transparent ones) and
+ *  SPECKR_ARENA_PREFAULT; without the latter each slot's pages are first
+ *  touched, and so placed, by the thread that acquires it.
+ *
+ *  speckr_session_acquire() returns SPECKR_SESSION_NONE when the table is full.
+ */
+typedef struct speckr_sessions speckr_sessions;
+
+#define SPECKR_SESSION_NONE UINT32_MAX
+
+speckr_sessions *speckr_sessions_new(speckr_key *key, uint32_t capacity, int flags);
+void speckr_sessions_free(speckr_sessions *t);
+uint32_t speckr_session_acquire(speckr_sessions *t);
+speckr_cursor *speckr_session_get(speckr_sessions *t, uint32_t id);
+void speckr_session_release(speckr_sessions *t, uint32_t id);
+
 void speckr_init(speckr_ctx *CTX, const char *password);
-/* copy CTX2 into CTX1 */
+
+/*
+ *  Key derivation profiles for speckr_init_ex():
+ *
+ *  SPECKR_KDF_V1  three chained single-lane argon2i passes (what speckr_init() does)
+ *  SPECKR_KDF_V2  one argon2i call over parallelism lanes whose 48 byte output holds
+ *                 the 96-bit key and the three 12 byte Sbox seeds
+ *
+ *  t_cost, m_cost (KiB), parallelism (lanes) and salt change the derived key; threads
+ *  only changes how many cores v2 uses (0 = one per lane, at most one per CPU).
+ *  speckr_kdf_defaults() fills in the defaults of a profile, with an all-zero salt
+ *  (what speckr_init() uses), and returns -1 without touching params for any other
+ *  profile. speckr_init_ex() returns the argon2 error code, ARGON2_OK (0) on success,
+ *  and ARGON2_INCORRECT_TYPE without deriving anything for an unknown profile.
+ */
+#define SPECKR_KDF_V1 1
+#define SPECKR_KDF_V2 2
+#define SPECKR_SALTLEN 16
+
+typedef struct {
+	int profile;
+	uint32_t t_cost;
+	uint32_t m_cost;
+	uint32_t parallelism;
+	uint32_t threads;
+	uint8_t salt[SPECKR_SALTLEN];
+} speckr_kdf_params;
+
+int speckr_kdf_defaults(speckr_kdf_params *params, int profile);
+int speckr_init_ex(speckr_ctx *CTX, const char *password, const speckr_kdf_params *params);
+
+/*
+ *  Argon2 runs in a library-wide arena that is reused by every pass and every
+ *  init and zeroed between uses; it is mapped on first use and kept. Reserve it
+ *  up front (m_cost * 1024 bytes) to pre-fault it, optionally on huge pages,
+ *  and release it when no more contexts will be created. Both calls are no-ops
+ *  while an init is using the arena; reserve then returns -1.
+ */
+#define SPECKR_ARENA_PREFAULT 1
+#define SPECKR_ARENA_HUGE     2
+int speckr_arena_reserve(size_t bytes, int flags);
+void speckr_arena_release(void);
+/*
+ *  speckr_ctx_dup() copies CTX2 into CTX1. speckr_reset_ctr() rewinds CTX to
+ *  block 0 of its stream, i.e. it is speckr_seek(CTX, 0).
+ *
+ *  Compatibility: speckr_reset_ctr() now also restores Sbox1/Sbox2 to their
+ *  speckr_init() values. Before speckr_seek() existed it only zeroed NL, NR,
+ *  it1, it2 and loop and kept the evolved Sboxes, so a context reset after
+ *  2000 or more blocks produced a keystream that matched no position of the
+ *  stream. Data written that way by earlier versions decrypts only with the
+ *  old behaviour.
+ */
 void speckr_ctx_dup(speckr_ctx *CTX1, speckr_ctx *CTX2);
 void speckr_reset_ctr(speckr_ctx *CTX);
 
+/*
+ *  Positions CTX at block block_index of the stream that starts at speckr_init()
+ *  (counter, loop, it1/it2 and the evolved Sbox1/Sbox2) without encrypting the
+ *  blocks before it. Costs O(log n) Sbox compositions per 2000*2000 blocks.
+ *  speckr_reset_ctr() is speckr_seek(CTX, 0).
+ */
+void speckr_seek(speckr_ctx *CTX, uint64_t block_index);
+
+/*
+ *  Byte stream API: XORs len bytes of any alignment with the keystream, in == out
+ *  is allowed. Keystream bytes left over from a partial last block are kept in
+ *  CTX (or the cursor) and used first by the next call, so splitting a buffer
+ *  across calls at any byte gives the same output as one call.
+ *
+ *  Stream byte 8 * b + i is byte i of block b as SpeckREncrypt_blocks() stores
+ *  it, Ct[0] then Ct[1] in host byte order: the bytes are always the memory
+ *  layout of the uint32_t arrays the block functions take, so the byte and the
+ *  block APIs (and every mode of encrypt) produce the same files on any host.
+ *
+ *  Block calls and speckr_seek() drop the leftover bytes. speckr_cursor_stream_xor()
+ *  returns -1 only if speckr_cursor_encrypt() would.
+ */
+void speckr_stream_xor(speckr_ctx *CTX, const uint8_t *in, uint8_t *out, size_t len);
+int speckr_cursor_stream_xor(speckr_cursor *cur, const uint8_t *in, uint8_t *out, size_t len);
+
+/*
+ *  Encrypts or decrypts bytes [offset, offset + len) of the stream, e.g. a slice
+ *  of a file read with pread(), without processing the bytes before offset.
+ *  Bytes are the in-memory words SpeckREncrypt() takes; in == out is allowed.
+ *  CTX is left right after the last block it used.
+ */
+void speckr_crypt_range(speckr_ctx *CTX, uint64_t offset, const uint8_t *in, uint8_t *out, size_t len);
+
+/*
+ *  Keystream ring: a producer thread keeps up to depth blocks of keystream ready
+ *  for the stream that continues at CTX's current block (CTX itself is not
+ *  touched afterwards), so speckr_ring_xor() is a memory XOR. Bytes are those of
+ *  speckr_stream_xor() and calls may split the stream anywhere. When the ring
+ *  runs dry the missing bytes are generated inline and counted as an underrun;
+ *  the producer then skips ahead to where the consumer is.
+ *
+ *  capacity (blocks) is rounded up to a power of two and is also the initial
+ *  depth; speckr_ring_set_depth() lowers or raises the depth up to it. One
+ *  thread may call speckr_ring_xor() at a time. speckr_ring_new() returns NULL
+ *  if memory or the thread cannot be had. Link with -pthread.
+ */
+typedef struct speckr_ring speckr_ring;
+
+typedef struct {
+	uint64_t underruns;    // speckr_ring_xor() calls that generated bytes inline
+	uint64_t inline_bytes; // bytes they generated
+	uint64_t skips;        // times the producer jumped ahead to the consumer
+	uint64_t ready;        // keystream bytes in the ring now
+} speckr_ring_stat;
+
+speckr_ring *speckr_ring_new(speckr_ctx *CTX, size_t capacity);
+void speckr_ring_set_depth(speckr_ring *r, size_t blocks);
+void speckr_ring_xor(speckr_ring *r, const uint8_t *in, uint8_t *out, size_t len);
+void speckr_ring_stats(speckr_ring *r, speckr_ring_stat *st);
+void speckr_ring_free(speckr_ring *r);
+
+/*
+ *  Multi-threaded SpeckREncrypt_blocks(): the buffer is split into chunks of
+ *  SPECKR_CHUNK_BLOCKS handed to nthreads workers (<= 0: one per CPU) that steal
+ *  from each other when idle. Output and final CTX are the same as sequential.
+ *  CTX must be a plain SpeckREncrypt() stream (workers position with speckr_seek()).
+ *  Returns 0 on success, -1 on allocation failure. Link with -pthread.
+ */
+#define SPECKR_CHUNK_BLOCKS (64 * SPECKR_EPOCH) /* 1 MB */
+int speckr_encrypt_parallel(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX, int nthreads);
+
+/*
+ *  SpeckREncrypt_blocks() fused with a BLAKE3 hash of the bytes going in
+ *  (SPECKR_HASH_IN) or coming out (SPECKR_HASH_OUT): every SPECKR_HASH_PIECE
+ *  bytes are hashed right before or after they are encrypted, while they are
+ *  in cache. The bytes of this call are appended to what h already has, so a
+ *  file can go through several calls before blake3_hasher_finalize().
+ *
+ *  The parallel version uses BLAKE3's tree mode: the worker that encrypts a
+ *  chunk also hashes the whole BLAKE3 chunks in it, the calling thread merges
+ *  the subtree chaining values in order and hashes the last BLAKE3 chunk of
+ *  the call itself. If h does not end on a BLAKE3 chunk boundary the call
+ *  first evens it out; when that cannot be done in whole blocks the hash is a
+ *  second pass over the buffer. It cannot fail: without memory for the workers
+ *  it runs speckr_encrypt_hash() on the calling thread.
+ */
+#define SPECKR_HASH_IN 0
+#define SPECKR_HASH_OUT 1
+#define SPECKR_HASH_PIECE (16 * BLAKE3_CHUNK_LEN) /* needs blake3.h */
+void speckr_encrypt_hash(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX, struct blake3_hasher *h, int what);
+void speckr_encrypt_parallel_hash(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX, int nthreads, 
+                                  struct blake3_hasher *h, int what);
+
+#endif /* SPECKR_H */
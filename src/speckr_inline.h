@@ -0,0 +1,112 @@
+/*
+ *      The per-block keystream of SpeckREncrypt() as static inline functions, so
+ *      a loop in another translation unit can inline it and fuse the XOR with its
+ *      own loads and stores instead of calling into speckr.o every 8 bytes.
+ *
+ *      speckr.c builds SpeckREncrypt() and SpeckREncrypt_async() from these same
+ *      functions, so the inline and the library paths give identical bytes.
+ *      Include after speckr.h.
+ *
+ *      This program is free software: you can redistribute it and/or modify it under the terms of the
+ *      GNU General Public License as published by the Free Software Foundation,
+ *      either version 3 of the License, or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *      without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *      See the GNU General Public License for more details.
+ *      You should have received a copy of the GNU General Public License along with this program.
+ *      If not, see <https://www.gnu.org/licenses/>.
+*/
+
+static inline uint32_t speckr_inline_bswap32(uint32_t w) {
+	return (w << 24) | (w >> 24) | ((w << 8) & 0xFF0000) | ((w >> 8) & 0xFF00);
+}
+
+static inline uint32_t speckr_inline_sbox32(const uint8_t *S, uint32_t w) {
+	return (uint32_t)S[w >> 24 & 0xFF] << 24 | (uint32_t)S[w >> 16 & 0xFF] << 16 |
+		(uint32_t)S[w >> 8 & 0xFF] << 8 | S[w & 0xFF];
+}
+
+/*
+ *  The round keys of a block are the window derived_key_r[loop .. loop + 6] and
+ *  loop only takes 18 values, so every window gets its own fully unrolled round
+ *  function with constant key offsets.
+ */
+#if SPECKR_ROUNDS != 7
+#error "speckr_rounds_L() are unrolled for 7 rounds"
+#endif
+
+#define SPECKR_ROUNDS_FN(L) \
+static inline void speckr_rounds_##L(uint32_t *px, uint32_t *py, const uint32_t *rk) { \
+	uint32_t x = *px, y = *py; \
+	ER32(x, y, rk[L]);     ER32(x, y, rk[L + 1]); ER32(x, y, rk[L + 2]); ER32(x, y, rk[L + 3]); \
+	ER32(x, y, rk[L + 4]); ER32(x, y, rk[L + 5]); ER32(x, y, rk[L + 6]); \
+	*px = x; *py = y; \
+}
+
+SPECKR_ROUNDS_FN(0)  SPECKR_ROUNDS_FN(1)  SPECKR_ROUNDS_FN(2)  SPECKR_ROUNDS_FN(3)
+SPECKR_ROUNDS_FN(4)  SPECKR_ROUNDS_FN(5)  SPECKR_ROUNDS_FN(6)  SPECKR_ROUNDS_FN(7)
+SPECKR_ROUNDS_FN(8)  SPECKR_ROUNDS_FN(9)  SPECKR_ROUNDS_FN(10) SPECKR_ROUNDS_FN(11)
+SPECKR_ROUNDS_FN(12) SPECKR_ROUNDS_FN(13) SPECKR_ROUNDS_FN(14) SPECKR_ROUNDS_FN(15)
+SPECKR_ROUNDS_FN(16) SPECKR_ROUNDS_FN(17)
+
+#define SPECKR_ROUNDS_CASE(L) case L: speckr_rounds_##L(&x, &y, CTX->derived_key_r); break;
+
+/*
+ *  Keystream of the block at CTX's counter, CTX is not moved: the byte-swapped
+ *  counter NL:NR goes through the unrolled rounds of key window loop, then
+ *  each half is masked with Sbox1 of the other. SpeckREncrypt() XORs ks[0]
+ *  into Pt[0] and ks[1] into Pt[1].
+ */
+static inline void speckr_keystream_at(const speckr_ctx *CTX, uint32_t ks[2]) {
+	uint32_t x = speckr_inline_bswap32(CTX->NL), y = speckr_inline_bswap32(CTX->NR);
+
+	switch (CTX->loop) {
+	SPECKR_ROUNDS_CASE(0)  SPECKR_ROUNDS_CASE(1)  SPECKR_ROUNDS_CASE(2)  SPECKR_ROUNDS_CASE(3)
+	SPECKR_ROUNDS_CASE(4)  SPECKR_ROUNDS_CASE(5)  SPECKR_ROUNDS_CASE(6)  SPECKR_ROUNDS_CASE(7)
+	SPECKR_ROUNDS_CASE(8)  SPECKR_ROUNDS_CASE(9)  SPECKR_ROUNDS_CASE(10) SPECKR_ROUNDS_CASE(11)
+	SPECKR_ROUNDS_CASE(12) SPECKR_ROUNDS_CASE(13) SPECKR_ROUNDS_CASE(14) SPECKR_ROUNDS_CASE(15)
+	SPECKR_ROUNDS_CASE(16) SPECKR_ROUNDS_CASE(17)
+	}
+
+	ks[0] = y ^ speckr_inline_sbox32(CTX->Sbox1, x);
+	ks[1] = x ^ speckr_inline_sbox32(CTX->Sbox1, y);
+}
+
+/*
+ *  Moves CTX past the block speckr_keystream_at() just used, except for the
+ *  counter itself (SpeckREncrypt() increments NR, SpeckREncrypt_async() sets
+ *  it per call). The Sbox update at the end of an epoch is out of line.
+ */
+static inline void speckr_next_inline(speckr_ctx *CTX) {
+	CTX->it1++;
+	CTX->it2++;
+	CTX->blkno++;
+	CTX->ks_avail = 0;
+	if (__builtin_expect(CTX->it1 == SPECKR_EPOCH, 0))
+		speckr__sbox_update(CTX);
+	CTX->loop = (CTX->loop + SPECKR_ROUNDS) % (25 - SPECKR_ROUNDS);
+}
+
+/* SpeckREncrypt(), Pt and Ct may be the same */
+static inline void SpeckREncrypt_inline(const uint32_t Pt[], uint32_t *Ct, speckr_ctx *CTX) {
+	uint32_t ks[2];
+
+	speckr_keystream_at(CTX, ks);
+	CTX->NR++;
+	Ct[0] = Pt[0] ^ ks[0];
+	Ct[1] = Pt[1] ^ ks[1];
+	speckr_next_inline(CTX);
+}
+
+/*
+ *  nblocks of SpeckREncrypt_inline(), the same bytes as SpeckREncrypt_blocks().
+ *  Worth it for short buffers where the kernels' setup dominates; inline
+ *  blocks are not counted in speckr_stats (their Sbox updates are).
+ */
+static inline void speckr_xor_inline(speckr_ctx *CTX, const uint32_t *Pt, uint32_t *Ct, size_t nblocks) {
+	size_t i;
+
+	for (i = 0; i < nblocks; i++)
+		SpeckREncrypt_inline(Pt + 2 * i, Ct + 2 * i, CTX);
+}
@@ -0,0 +1,349 @@
+/*
+ *      Multi-threaded SpeckR encryption with work-stealing chunks.
+ *
+ *      (C) 2024 Alin-Adrian Anton <alin.anton@cs.upt.ro>, Petra Csereoka <petra.csereoka@cs.upt.ro>
+ *
+ *      This program is free software: you can redistribute it and/or modify it under the terms of the
+ *      GNU General Public License as published by the Free Software Foundation,
+ *      either version 3 of the License, or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *      without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *      See the GNU General Public License for more details.
+ *      You should have received a copy of the GNU General Public License along with this program.
+ *      If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "speckr.h"
+#include "speckr_probe.h"
+
+#include "blake3.h" // speckr_encrypt_parallel_hash()
+
+/*
+ *  Every worker owns a range [lo, hi) of chunk indices packed in one 64-bit word.
+ *  The owner takes chunks from the front, idle workers steal from the back;
+ *  both sides move the range with a CAS so no lock is needed. lo only grows and
+ *  hi only shrinks, hence no ABA.
+ */
+typedef struct {
+    uint64_t range;                   // lo << 32 | hi
+    char pad[64 - sizeof(uint64_t)];  // one range per cache line
+} speckr_deque;
+
+typedef struct speckr_pool speckr_pool;
+
+typedef struct {
+    speckr_pool *pool;
+    int id;
+    speckr_ctx CTX;                   // private cursor
+    speckr_stats st;                  // counters of the thread, added to the caller's at the end
+} speckr_worker;
+
+struct speckr_pool {
+    const uint32_t *Pt;
+    uint32_t *Ct;
+    size_t nblocks;
+    uint64_t base;                    // stream position of Pt[0]
+    size_t nchunks;
+    int nworkers;
+    speckr_deque *dq;
+    speckr_worker *w;
+
+    /* BLAKE3 tree hashing, h is NULL without */
+    const blake3_hasher *h;           // only read by the workers
+    int what;                         // SPECKR_HASH_IN or SPECKR_HASH_OUT
+    uint64_t h0;                      // BLAKE3 chunk counter of Pt[0]
+    size_t hchunks;                   // whole BLAKE3 chunks hashed by the workers
+    uint8_t (*cv)[BLAKE3_OUT_LEN];    // subtree values, those of chunk i from cv[cvoff[i]]
+    size_t *cvoff;
+    uint8_t tail[BLAKE3_CHUNK_LEN];   // input after the last whole BLAKE3 chunk
+};
+
+/* 8 * SPECKR_CHUNK_BLOCKS is a multiple of BLAKE3_CHUNK_LEN, chunks never split a BLAKE3 chunk */
+#define SPECKR_CHUNK_HASHES (8 * SPECKR_CHUNK_BLOCKS / BLAKE3_CHUNK_LEN)
+#define SPECKR_PIECE_HASHES (SPECKR_HASH_PIECE / BLAKE3_CHUNK_LEN)
+
+#define RANGE(lo, hi) ((uint64_t)(lo) << 32 | (uint32_t)(hi))
+#define RANGE_LO(r) ((uint32_t)((r) >> 32))
+#define RANGE_HI(r) ((uint32_t)(r))
+
+static int speckr_pop_front(speckr_deque *d, uint32_t *chunk) {
+    uint64_t r = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
+
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        if (__atomic_compare_exchange_n(&d->range, &r, RANGE(RANGE_LO(r) + 1, RANGE_HI(r)),
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = RANGE_LO(r);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int speckr_pop_back(speckr_deque *d, uint32_t *chunk) {
+    uint64_t r = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
+
+    while (RANGE_LO(r) < RANGE_HI(r)) {
+        if (__atomic_compare_exchange_n(&d->range, &r, RANGE(RANGE_LO(r), RANGE_HI(r) - 1),
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = RANGE_HI(r) - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* the largest aligned power of two run of BLAKE3 chunks that starts at c and ends by end */
+static size_t speckr_subtree(uint64_t c, uint64_t end) {
+    size_t s = 1;
+
+    while (c % (2 * s) == 0 && c + 2 * s <= end)
+        s *= 2;
+    return s;
+}
+
+/* BLAKE3 chunks [*c, *end) of the call that chunk hashes, relative to Pt */
+static void speckr_hash_span(const speckr_pool *p, uint32_t chunk, uint64_t *c, uint64_t *end) {
+    *c = (uint64_t)chunk * SPECKR_CHUNK_HASHES;
+    *end = *c + SPECKR_CHUNK_HASHES < p->hchunks ? *c + SPECKR_CHUNK_HASHES : p->hchunks;
+}
+
+/*
+ *  Each subtree of the chunk is encrypted and hashed SPECKR_HASH_PIECE bytes
+ *  at a time; the piece values are joined on a small stack, like a binary
+ *  counter, into the subtree value. Blocks past the last whole BLAKE3 chunk
+ *  are only encrypted, the last worker saves their input for the caller.
+ */
+static void speckr_hash_chunk(speckr_worker *w, uint32_t chunk, size_t n) {
+    speckr_pool *p = w->pool;
+    const size_t bpc = BLAKE3_CHUNK_LEN / 8; // blocks per BLAKE3 chunk
+    uint8_t stack[12][BLAKE3_OUT_LEN], (*cv)[BLAKE3_OUT_LEN] = p->cv + p->cvoff[chunk];
+    uint64_t c, end, m;
+    size_t s, piece, k, depth, done;
+    const uint8_t *in;
+    uint8_t *out;
+
+    speckr_hash_span(p, chunk, &c, &end);
+    done = (size_t)(end - c) * bpc;
+    if (p->what == SPECKR_HASH_IN && done < n) // only the last chunk has a tail
+        memcpy(p->tail, (const uint8_t *)p->Pt + BLAKE3_CHUNK_LEN * end, 8 * p->nblocks - BLAKE3_CHUNK_LEN * end);
+
+    for (; c < end; c += s) {
+        s = speckr_subtree(p->h0 + c, p->h0 + end);
+        piece = s < SPECKR_PIECE_HASHES ? s : SPECKR_PIECE_HASHES;
+        for (k = 0, depth = 0; k < s; k += piece) {
+            in = (const uint8_t *)p->Pt + BLAKE3_CHUNK_LEN * (c + k);
+            out = (uint8_t *)p->Ct + BLAKE3_CHUNK_LEN * (c + k);
+            if (p->what == SPECKR_HASH_IN)
+                blake3_subtree_cv(p->h, in, piece, p->h0 + c + k, stack[depth]);
+            SpeckREncrypt_blocks((const uint32_t *)in, (uint32_t *)out, piece * bpc, &w->CTX);
+            if (p->what == SPECKR_HASH_OUT)
+                blake3_subtree_cv(p->h, out, piece, p->h0 + c + k, stack[depth]);
+            for (depth++, m = k / piece + 1; m % 2 == 0; m /= 2, depth--)
+                blake3_parent_cv(p->h, stack[depth - 2], stack[depth - 1], stack[depth - 2]);
+        }
+        memcpy(*cv++, stack[0], BLAKE3_OUT_LEN);
+    }
+
+    if (done < n) {
+        in = (const uint8_t *)p->Pt + BLAKE3_CHUNK_LEN * end;
+        out = (uint8_t *)p->Ct + BLAKE3_CHUNK_LEN * end;
+        SpeckREncrypt_blocks((const uint32_t *)in, (uint32_t *)out, n - done, &w->CTX);
+    }
+}
+
+static void speckr_do_chunk(speckr_worker *w, uint32_t chunk) {
+    speckr_pool *p = w->pool;
+    size_t first = (size_t)chunk * SPECKR_CHUNK_BLOCKS;
+    size_t n = p->nblocks - first;
+
+    if (n > SPECKR_CHUNK_BLOCKS)
+        n = SPECKR_CHUNK_BLOCKS;
+    if (w->CTX.blkno != p->base + first) // first chunk or after a steal
+        speckr_seek(&w->CTX, p->base + first);
+    if (p->h != NULL)
+        speckr_hash_chunk(w, chunk, n);
+    else
+        SpeckREncrypt_blocks(p->Pt + 2 * first, p->Ct + 2 * first, n, &w->CTX);
+}
+
+static void *speckr_worker_run(void *arg) {
+    speckr_worker *w = arg;
+    speckr_pool *p = w->pool;
+    uint32_t chunk;
+    int i, victim;
+
+    while (speckr_pop_front(&p->dq[w->id], &chunk))
+        speckr_do_chunk(w, chunk);
+
+    /* own range is empty, steal from the others until all are empty */
+    for (i = 1; i < p->nworkers; i++) {
+        victim = (w->id + i) % p->nworkers;
+        while (speckr_pop_back(&p->dq[victim], &chunk))
+            speckr_do_chunk(w, chunk);
+    }
+    if (w->id != 0) 
+        speckr_stats_get(&w->st);
+    return NULL;
+}
+
+/* threads worth starting for nchunks chunks, <= 1 means run sequentially */
+static int speckr_threads(size_t nchunks, int nthreads) {
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if ((size_t)nthreads > nchunks)
+        nthreads = (int)nchunks;
+    return nchunks > UINT32_MAX ? 1 : nthreads;
+}
+
+/*
+ *  Runs the chunks of pool on nthreads workers, the calling thread is worker 0.
+ *  Returns -1 if the pool could not be allocated (nothing is encrypted then).
+ *  If some threads fail to start the others do their chunks.
+ */
+static int speckr_pool_run(speckr_pool *pool, speckr_ctx *CTX, int nthreads) {
+    pthread_t *tid;
+    size_t per, lo;
+    int i, started;
+
+    pool->base = CTX->blkno;
+    pool->nworkers = nthreads;
+    pool->dq = aligned_alloc(64, nthreads * sizeof(speckr_deque));
+    pool->w = malloc(nthreads * sizeof(speckr_worker));
+    tid = malloc(nthreads * sizeof(pthread_t));
+    if (pool->dq == NULL || pool->w == NULL || tid == NULL) {
+        free(pool->dq); free(pool->w); free(tid);
+        return -1;
+    }
+
+    per = pool->nchunks / nthreads;
+    for (i = 0, lo = 0; i < nthreads; i++) {
+        size_t hi = lo + per + ((size_t)i < pool->nchunks % nthreads);
+
+        pool->dq[i].range = RANGE(lo, hi);
+        pool->w[i].pool = pool;
+        pool->w[i].id = i;
+        speckr_ctx_dup(&pool->w[i].CTX, CTX); // each worker seeks to its first chunk itself
+        lo = hi;
+    }
+
+    SPECKR_PROBE2(parallel_start, pool->nblocks, nthreads);
+    for (started = 1; started < nthreads; started++)
+        if (pthread_create(&tid[started], NULL, speckr_worker_run, &pool->w[started]) != 0)
+            break;
+    speckr_worker_run(&pool->w[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(tid[i], NULL);
+        speckr_stats_add(&pool->w[i].st);
+    }
+    SPECKR_PROBE2(parallel_done, pool->nblocks, started);
+
+    speckr_seek(CTX, pool->base + pool->nblocks);
+
+    free(pool->dq); free(pool->w); free(tid);
+    return 0;
+}
+
+/*
+ *  Splits Pt into SPECKR_CHUNK_BLOCKS chunks encrypted by nthreads workers
+ *  (nthreads <= 0 means one per online CPU). The output matches
+ *  SpeckREncrypt_blocks() and CTX ends up nblocks further into the stream.
+ *
+ *  Returns 0 on success, -1 if the pool could not be allocated (nothing is
+ *  encrypted then). If some threads fail to start the others do their chunks.
+ */
+int speckr_encrypt_parallel(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX, int nthreads) {
+    speckr_pool pool;
+
+    pool.nchunks = (nblocks + SPECKR_CHUNK_BLOCKS - 1) / SPECKR_CHUNK_BLOCKS;
+    nthreads = speckr_threads(pool.nchunks, nthreads);
+    if (nthreads <= 1) {
+        SpeckREncrypt_blocks(Pt, Ct, nblocks, CTX);
+        return 0;
+    }
+
+    pool.Pt = Pt;
+    pool.Ct = Ct;
+    pool.nblocks = nblocks;
+    pool.h = NULL;
+    return speckr_pool_run(&pool, CTX, nthreads);
+}
+
+/*
+ *  The subtrees of every chunk are counted up front so each worker knows where
+ *  to store its values; the caller pushes them into h in stream order once all
+ *  workers are done, then hashes the bytes after the last whole BLAKE3 chunk.
+ */
+void speckr_encrypt_parallel_hash(const uint32_t *Pt, uint32_t *Ct, size_t nblocks, speckr_ctx *CTX, int nthreads, 
+                                  blake3_hasher *h, int what) {
+    speckr_pool pool;
+    uint64_t c, end;
+    size_t lead, i, k, s;
+
+    if (blake3_hasher_next_chunk(h) == UINT64_MAX) { // even h out to a BLAKE3 chunk boundary
+        lead = BLAKE3_CHUNK_LEN - blake3_hasher_chunk_len(h);
+        if (lead % 8 != 0) { // not in whole blocks, hash in a second pass
+            if (what == SPECKR_HASH_IN)
+                blake3_hasher_update(h, Pt, 8 * nblocks);
+            if (speckr_encrypt_parallel(Pt, Ct, nblocks, CTX, nthreads) != 0)
+                SpeckREncrypt_blocks(Pt, Ct, nblocks, CTX);
+            if (what == SPECKR_HASH_OUT)
+                blake3_hasher_update(h, Ct, 8 * nblocks);
+            return;
+        }
+        lead = lead / 8 < nblocks ? lead / 8 : nblocks;
+        speckr_encrypt_hash(Pt, Ct, lead, CTX, h, what);
+        Pt += 2 * lead;
+        Ct += 2 * lead;
+        nblocks -= lead;
+    }
+
+    pool.nchunks = (nblocks + SPECKR_CHUNK_BLOCKS - 1) / SPECKR_CHUNK_BLOCKS;
+    nthreads = speckr_threads(pool.nchunks, nthreads);
+    if (nthreads <= 1) {
+        speckr_encrypt_hash(Pt, Ct, nblocks, CTX, h, what);
+        return;
+    }
+
+    pool.Pt = Pt;
+    pool.Ct = Ct;
+    pool.nblocks = nblocks;
+    pool.h = h;
+    pool.what = what;
+    pool.h0 = blake3_hasher_next_chunk(h);
+    pool.hchunks = (8 * nblocks - 1) / BLAKE3_CHUNK_LEN; // the last one goes through blake3_hasher_update()
+    pool.cvoff = malloc((pool.nchunks + 1) * sizeof(size_t));
+    if (pool.cvoff == NULL) {
+        speckr_encrypt_hash(Pt, Ct, nblocks, CTX, h, what);
+        return;
+    }
+    for (i = 0, k = 0; i < pool.nchunks; i++) {
+        pool.cvoff[i] = k;
+        for (speckr_hash_span(&pool, (uint32_t)i, &c, &end); c < end; c += s, k++)
+            s = speckr_subtree(pool.h0 + c, pool.h0 + end);
+    }
+    pool.cvoff[i] = k;
+    pool.cv = malloc(k * BLAKE3_OUT_LEN + 1);
+    if (pool.cv == NULL || speckr_pool_run(&pool, CTX, nthreads) != 0) {
+        free(pool.cv); free(pool.cvoff);
+        speckr_encrypt_hash(Pt, Ct, nblocks, CTX, h, what);
+        return;
+    }
+
+    for (i = 0, k = 0; i < pool.nchunks; i++)
+        for (speckr_hash_span(&pool, (uint32_t)i, &c, &end); c < end; c += s, k++) {
+            s = speckr_subtree(pool.h0 + c, pool.h0 + end);
+            blake3_hasher_push_subtree(h, pool.cv[k], s);
+        }
+    blake3_hasher_update(h, what == SPECKR_HASH_IN ? pool.tail : (const uint8_t *)Ct + BLAKE3_CHUNK_LEN * pool.hchunks, 
+                         8 * nblocks - BLAKE3_CHUNK_LEN * pool.hchunks);
+
+    free(pool.cv); free(pool.cvoff);
+}
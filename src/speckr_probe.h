@@ -0,0 +1,40 @@
+/*
+ *      Static tracepoints of the library.
+ *
+ *      Built with -DSPECKR_USDT (make USDT=1) they are sys/sdt.h probes of the
+ *      "speckr" provider, a single nop each until perf or bpftrace attaches:
+ *
+ *          bpftrace -e 'usdt:./encrypt:speckr:kdf_pass { @ns[arg0] = hist(arg1); }'
+ *          perf probe -x ./encrypt sdt_speckr:sbox1_update
+ *
+ *      Without it they compile to nothing, the arguments are side-effect free.
+ *
+ *      This program is free software: you can redistribute it and/or modify it under the terms of the
+ *      GNU General Public License as published by the Free Software Foundation,
+ *      either version 3 of the License, or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *      without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *      See the GNU General Public License for more details.
+ *      You should have received a copy of the GNU General Public License along with this program.
+ *      If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  init_start(profile)                      speckr_init_ex() entry
+ *  init_done(profile, ret)                  speckr_init_ex() return
+ *  kdf_pass(pass, ns)                       one Argon2 pass finished
+ *  sbox1_update(blkno), sbox2_update(blkno) epoch Sbox updates of a context
+ *  blocks_start(nblocks, blkno)             SpeckREncrypt_blocks() entry
+ *  blocks_done(nblocks, blkno)              SpeckREncrypt_blocks() return
+ *  parallel_start(nblocks, nthreads)        speckr_encrypt_parallel*() with workers
+ *  parallel_done(nblocks, nthreads)
+ */
+#ifdef SPECKR_USDT
+#include <sys/sdt.h>
+#define SPECKR_PROBE1(name, a) DTRACE_PROBE1(speckr, name, a)
+#define SPECKR_PROBE2(name, a, b) DTRACE_PROBE2(speckr, name, a, b)
+#else
+#define SPECKR_PROBE1(name, a) do { (void)(a); } while (0)
+#define SPECKR_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#endif
@@ -0,0 +1,185 @@
+/*
+ *      Keystream precomputation: a producer thread fills a single-producer,
+ *      single-consumer ring ahead of the consumer, so encrypting on the
+ *      critical path is a XOR with memory.
+ *
+ *      (C) 2024 Alin-Adrian Anton <alin.anton@cs.upt.ro>, Petra Csereoka <petra.csereoka@cs.upt.ro>
+ *
+ *      This program is free software: you can redistribute it and/or modify it under the terms of the
+ *      GNU General Public License as published by the Free Software Foundation,
+ *      either version 3 of the License, or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *      without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *      See the GNU General Public License for more details.
+ *      You should have received a copy of the GNU General Public License along with this program.
+ *      If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "speckr.h"
+
+/*
+ *  head and tail are absolute stream byte offsets: keystream byte p lives in
+ *  ks[p % size] while tail <= p < head. The producer only moves head and the
+ *  consumer only moves tail, each on its own cache line. When the consumer has
+ *  to generate bytes inline it moves tail past head; the producer notices and
+ *  seeks its context to the block holding tail instead of producing bytes
+ *  nobody will read.
+ */
+#define SPECKR_RING_BATCH 512 // blocks per producer step
+#define SPECKR_RING_SPIN 1000 // polls of a full ring before sleeping
+
+struct speckr_ring {
+    uint64_t head;
+    char pad0[64 - sizeof(uint64_t)];
+    uint64_t tail;
+    char pad1[64 - sizeof(uint64_t)];
+    uint64_t depth;                    // bytes the producer keeps ready, <= size
+    int stop;
+    uint64_t size;                     // power of two, multiple of 8
+    uint32_t *ks;
+    speckr_ctx prod;                   // producer position, head / 8
+    speckr_ctx cons;                   // inline fallback of the consumer
+    uint64_t underruns, inline_bytes, skips;
+    speckr_stats st;                   // producer counters, added to the caller's by speckr_ring_free()
+    pthread_t tid;
+};
+
+/* memset through a volatile pointer so the wipe before free() is not optimized away */
+static void *(*const volatile speckr_ring_wipe)(void *, int, size_t) = memset;
+
+static void speckr_ring_pause(int *spins) {
+    struct timespec ts = { 0, 20000 };
+
+    if (++*spins < SPECKR_RING_SPIN) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return;
+    }
+    nanosleep(&ts, NULL);
+}
+
+static void *speckr_ring_producer(void *arg) {
+    speckr_ring *r = arg;
+    uint64_t head = r->head, tail, room, n;
+    uint32_t *w;
+    int spins = 0;
+
+    while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head < tail) { // the consumer went inline past us, restart where it is
+            head = tail / 8 * 8;
+            speckr_seek(&r->prod, head / 8);
+            __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&r->skips, 1, __ATOMIC_RELAXED);
+        }
+
+        room = __atomic_load_n(&r->depth, __ATOMIC_RELAXED);
+        if (head > tail) // bytes ready, a restart leaves head up to 7 bytes behind tail
+            room = head - tail < room ? room - (head - tail) : 0;
+        room /= 8;
+        if (room == 0) {
+            speckr_ring_pause(&spins);
+            continue;
+        }
+        spins = 0;
+
+        n = (r->size - head % r->size) / 8; // up to the end of the ring
+        if (n > room)
+            n = room;
+        if (n > SPECKR_RING_BATCH)
+            n = SPECKR_RING_BATCH;
+        w = r->ks + head % r->size / 4;
+        memset(w, 0, 8 * n);
+        SpeckREncrypt_blocks(w, w, n, &r->prod); // keystream = encryption of zeros, in host words
+        head += 8 * n;
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    }
+    speckr_stats_get(&r->st);
+    return NULL;
+}
+
+speckr_ring *speckr_ring_new(speckr_ctx *CTX, size_t capacity) {
+    speckr_ring *r;
+    uint64_t size = 64;
+
+    while (size < 8 * (uint64_t)capacity)
+        size *= 2;
+    if ((r = aligned_alloc(64, sizeof(*r))) == NULL)
+        return NULL;
+    if ((r->ks = aligned_alloc(64, size)) == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->size = r->depth = size;
+    r->head = r->tail = CTX->blkno * 8;
+    r->stop = 0;
+    r->underruns = r->inline_bytes = r->skips = 0;
+    speckr_ctx_dup(&r->prod, CTX);
+    speckr_ctx_dup(&r->cons, CTX);
+    speckr_seek(&r->prod, CTX->blkno); // drops leftover stream bytes of CTX
+    speckr_seek(&r->cons, CTX->blkno);
+
+    if (pthread_create(&r->tid, NULL, speckr_ring_producer, r) != 0) {
+        free(r->ks);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void speckr_ring_set_depth(speckr_ring *r, size_t blocks) {
+    uint64_t depth = 8 * (uint64_t)blocks;
+
+    __atomic_store_n(&r->depth, depth < 8 ? 8 : depth > r->size ? r->size : depth, __ATOMIC_RELAXED);
+}
+
+void speckr_ring_xor(speckr_ring *r, const uint8_t *in, uint8_t *out, size_t len) {
+    const uint8_t *ks = (const uint8_t *)r->ks;
+    uint64_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t avail = head > tail ? head - tail : 0, n, i, k, off;
+
+    if (avail > len)
+        avail = len;
+    for (n = 0; n < avail; n += i) { // at most two pieces around the end of the ring
+        off = (tail + n) % r->size;
+        i = r->size - off < avail - n ? r->size - off : avail - n;
+        for (k = 0; k < i; k++)
+            out[n + k] = in[n + k] ^ ks[off + k];
+    }
+
+    if (avail < len) { // underrun: the rest is generated here
+        speckr_crypt_range(&r->cons, tail + avail, in + avail, out + avail, len - avail);
+        r->underruns++;
+        r->inline_bytes += len - avail;
+    }
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+}
+
+void speckr_ring_stats(speckr_ring *r, speckr_ring_stat *st) {
+    st->underruns = r->underruns;
+    st->inline_bytes = r->inline_bytes;
+    st->skips = __atomic_load_n(&r->skips, __ATOMIC_RELAXED);
+    st->ready = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    st->ready = st->ready > r->tail ? st->ready - r->tail : 0;
+}
+
+void speckr_ring_free(speckr_ring *r) {
+    if (r == NULL)
+        return;
+    __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(r->tid, NULL);
+    speckr_stats_add(&r->st);
+    speckr_ring_wipe(r->ks, 0, r->size);
+    free(r->ks);
+    speckr_ring_wipe(r, 0, sizeof *r);   // prod and cons hold the key schedule
+    free(r);
+}
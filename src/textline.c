@@ -29,67 +29,22 @@
 #define MAXLINESIZE 8192 // jumbo frames multiple of 8 bytes
 
 
-// Helper function to extract a specific byte from a multi-byte value
-// regardless of system's endianness (assuming big-endian processing)
-uint8_t get_byte(uint32_t value, size_t index) {
-  return (value >> (8 * (3 - index))) & 0xFF;
-}
-
-
-// Function to convert a string to blocks
-void string_to_blocks(const char *input, size_t input_len, uint32_t *blocks,
-                      size_t *num_blocks) {
-  size_t i, j;
-  size_t num_full_blocks = input_len / 4;
-  size_t remaining_bytes = input_len % 4;
-
-  *num_blocks = num_full_blocks + (remaining_bytes > 0 ? 1 : 0);
-
-  for (i = 0; i < num_full_blocks; i++) {
-    blocks[i] = 0;
-    for (j = 0; j < 4; j++) {
-      blocks[i] = (blocks[i] << 8) | (uint8_t)input[i * 4 + j];
-    }
-  }
-
-  if (remaining_bytes > 0) {
-    blocks[*num_blocks - 1] = 0;
-    for (j = 0; j < remaining_bytes; j++) {
-      blocks[*num_blocks - 1] = (blocks[*num_blocks - 1] << 8) |
-                                (uint8_t)input[num_full_blocks * 4 + j];
-    }
-  }
-}
-
-// Function to convert blocks back to string with big-endian processing
-void blocks_to_string(const uint32_t *blocks, size_t num_blocks, char *output,
-                      size_t *output_len) {
-  size_t i, j;
-  size_t output_index = 0;
-  size_t remaining_bytes = num_blocks * 4;
-
-  *output_len = remaining_bytes;
-  output[*output_len] = '\0';  // Null terminate the output string
-
-  for (i = 0; i < num_blocks; i++) {
-    for (j = 0; j < 4 && output_index < *output_len; j++) {
-      uint8_t byte = get_byte(blocks[i], j);
-      if (byte) {
-        output[output_index++] = byte;
-      }
+static void print_words(const char *title, const char *buf, size_t len) {
+    printf("%s:\n", title);
+    for (size_t i = 0; i < len; i++) {
+        printf("%02x%s", (uint8_t)buf[i], i % 4 == 3 ? " " : "");
     }
-  }
+    printf("\n");
 }
 
 
 int main(int argc, char *argv[]) {
     struct termios original,noecho; /* this is for reading password with no echo on screen */
     speckr_ctx CTX;
-    uint32_t pt[2], ct[2]; /* plaintext is 64 bits, ciphertext is 64 bits, key will be derived from passwd: 96 bits */
+    /* plaintext is 64 bits, ciphertext is 64 bits, key will be derived from passwd: 96 bits */
     char passwd[MAXPWDLEN];
-    size_t pwdlen, input_len=0, num_blocks;
+    size_t pwdlen, input_len=0;
     char msg[MAXLINESIZE];
-    uint32_t ct_blocks[MAXLINESIZE*2/8], pt_blocks[MAXLINESIZE*2/8]; // multiple of 8
     /* read password without printing echo bytes on screen */
 
     tcgetattr(STDIN_FILENO,&original);
@@ -114,61 +69,22 @@ int main(int argc, char *argv[]) {
     fgets(msg, MAXLINESIZE, stdin);
     input_len = strlen(msg);
 
-    string_to_blocks(msg, input_len, pt_blocks, &num_blocks);
+    printf("Message is %zu bytes\n", input_len);
 
-    printf("Number of blocks is %zu\n", num_blocks);
+    print_words("Unencrypted words", msg, input_len);
 
-    // Print unencrypted blocks
-    printf("Unencrypted Blocks:\n");
-    for (size_t i = 0; i < num_blocks; i++) {
-        printf("%08x ", pt_blocks[i]);
-    }
-    printf("\n");
-
-    /* first call encrypts pt into ct using the key from CTX */
-
-    // Encrypt each block
-    for (size_t i = 0; i < num_blocks; i += 2) {
-    	pt[0] = pt_blocks[i];
-    	pt[1] = pt_blocks[i+1];   
-        SpeckREncrypt(pt, ct, &CTX);
-	ct_blocks[i] = ct[0];
-	ct_blocks[i+1] = ct[1];
-    }
+    /* first call encrypts the message in place as message 0 using the key from CTX */
 
-   // Print blocks
-    printf("Encrypted Blocks:\n");
-    for (size_t i = 0; i < num_blocks; i++) {
-        printf("%08x ", ct_blocks[i]);
-    }
-    printf("\n");
+    speckr_msg_seal(&CTX, 0, msg, input_len);
 
-    speckr_reset_ctr(&CTX);
+    print_words("Encrypted words", msg, input_len);
 
-    // second call decrypts ct into pt using the key from CTX 
-  
+    // second call decrypts it in place, message 0 again starts from its own counter
+    speckr_msg_open(&CTX, 0, msg, input_len);
 
-      // Decrypt each block
-    for (size_t i = 0; i < num_blocks; i += 2) {
-    	ct[0] = ct_blocks[i];
-    	ct[1] = ct_blocks[i+1];    
-        SpeckREncrypt(ct, pt, &CTX);
-	pt_blocks[i] = pt[0];
-	pt_blocks[i+1] = pt[1];
+    print_words("Decrypted words", msg, input_len);
 
-    }
-
-    // Print encrypted blocks
-    printf("Decrypted Blocks:\n");
-    for (size_t i = 0; i < num_blocks; i++) {
-        printf("%08x ", pt_blocks[i]);
-    }
-    printf("\n");
-    
-    msg[0] = 0;
-    // Convert decrypted blocks back to string
-    blocks_to_string(pt_blocks, num_blocks, msg, &input_len);
-    printf("Decrypted and reconstructed string: %s\n", msg);
+    printf("Decrypted string: %.*s", (int)input_len, msg);
     
     return 0;
 }